@@ -0,0 +1,81 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/wait_free_queue.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <string>
+
+// Constants
+constexpr static size_t kQueueCapacity = 4096;
+constexpr static uint64_t kNumItems = kQueueCapacity;
+
+static uint64_t PushAndPopAll(ftl::WaitFreeQueue<uint64_t, kQueueCapacity> *queue) {
+	queue->PushBatch(kNumItems, [](size_t i) {
+		return static_cast<uint64_t>(i);
+	});
+
+	uint64_t total = 0;
+	uint64_t value;
+	while (queue->Pop(&value)) {
+		total += value;
+	}
+	return total;
+}
+
+static uint64_t PushAndStealAll(ftl::WaitFreeQueue<uint64_t, kQueueCapacity> *queue) {
+	queue->PushBatch(kNumItems, [](size_t i) {
+		return static_cast<uint64_t>(i);
+	});
+
+	uint64_t total = 0;
+	uint64_t value;
+	while (queue->Steal(&value)) {
+		total += value;
+	}
+	return total;
+}
+
+/**
+ * Compares the cost of the owner popping its own queue, with a full fence in Pop(), and with asymmetric fences
+ *
+ * Asymmetric fences move the cost to the thieves, so the steal numbers show the other side of the trade
+ * If the OS doesn't support asymmetric fences, both modes are the same
+ */
+TEST_CASE("WaitFreeQueue Pop benchmark") {
+	for (bool const asymmetricFences : { false, true }) {
+		std::string const mode = asymmetricFences ? " - asymmetric fences" : " - full fences";
+		ftl::WaitFreeQueue<uint64_t, kQueueCapacity> queue(asymmetricFences);
+
+		BENCHMARK(std::string("Push + Pop ") + std::to_string(kNumItems) + mode) {
+			return PushAndPopAll(&queue);
+		};
+
+		BENCHMARK(std::string("Push + Steal ") + std::to_string(kNumItems) + mode) {
+			return PushAndStealAll(&queue);
+		};
+	}
+}
@@ -0,0 +1,97 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/benchmark/catch_benchmark.hpp"
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+#include <string>
+
+// Constants
+constexpr static unsigned kNumLookups = 1000000;
+
+static volatile unsigned g_baselineValue = 0;
+
+void BaselineLoopTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	auto *sink = reinterpret_cast<std::atomic<unsigned> *>(arg);
+
+	// The same loop, with a plain load instead of the lookup
+	unsigned total = 0;
+	for (unsigned i = 0; i < kNumLookups; ++i) {
+		total += g_baselineValue;
+	}
+
+	sink->fetch_add(total, std::memory_order_relaxed);
+}
+
+void ThreadIndexLookupTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	auto *sink = reinterpret_cast<std::atomic<unsigned> *>(arg);
+
+	unsigned total = 0;
+	for (unsigned i = 0; i < kNumLookups; ++i) {
+		total += taskScheduler->GetCurrentThreadIndex();
+	}
+
+	// Publish the result, so the lookups can't be optimized away
+	sink->fetch_add(total, std::memory_order_relaxed);
+}
+
+static void BenchmarkLoop(std::string const &name, ftl::TaskFunction loop, unsigned threadCount) {
+	BENCHMARK_ADVANCED(name + " - " + std::to_string(threadCount) + " threads")
+	(Catch::Benchmark::Chronometer meter) {
+		ftl::TaskScheduler taskScheduler;
+		ftl::TaskSchedulerInitOptions options;
+		options.ThreadPoolSize = threadCount;
+		options.Behavior = ftl::EmptyQueueBehavior::Yield;
+		taskScheduler.Init(options);
+
+		std::atomic<unsigned> sink(0);
+
+		// The whole loop runs inside a single task, so the time is dominated by the loop, not the scheduling
+		meter.measure([&taskScheduler, loop, &sink] {
+			ftl::WaitGroup wg(&taskScheduler);
+			taskScheduler.AddTask(ftl::Task{ loop, &sink }, ftl::TaskPriority::Normal, &wg);
+			wg.Wait();
+		});
+	};
+}
+
+/**
+ * Measures the cost of TaskScheduler::GetCurrentThreadIndex() as the thread count grows
+ *
+ * Each run calls it kNumLookups times in a tight loop, inside one task. The baseline runs the same loop with a plain load
+ * instead, so the difference between the two is the cost of the lookups. If the lookup is O(1), it should stay flat as we
+ * add threads
+ */
+TEST_CASE("ThreadIndex benchmark") {
+	const unsigned threadCounts[] = { 1, 4, 16, 64, 128 };
+
+	for (unsigned const threadCount : threadCounts) {
+		BenchmarkLoop("Baseline loop", BaselineLoopTask, threadCount);
+		BenchmarkLoop("GetCurrentThreadIndex", ThreadIndexLookupTask, threadCount);
+	}
+}
@@ -34,4 +34,47 @@ size_t SystemPageSize();
 void *AlignedAlloc(size_t size, size_t alignment);
 void AlignedFree(void *block);
 
+/**
+ * Reserves a range of address space, without backing it with memory
+ * Any access to the range will fault until it is committed with MemoryCommit()
+ *
+ * @param bytes    The number of bytes to reserve. Should be a multiple of SystemPageSize()
+ * @return         The start of the range, or nullptr on failure
+ */
+void *MemoryReserve(size_t bytes);
+/**
+ * Releases a range created by MemoryReserve()
+ *
+ * @param memory    The pointer returned by MemoryReserve()
+ * @param bytes     The size passed to MemoryReserve()
+ */
+void MemoryReserveRelease(void *memory, size_t bytes);
+/**
+ * Makes part of a reserved range readable and writable
+ * Physical pages are still only allocated by the OS when they are first touched
+ *
+ * @param memory    The start of the range to commit. Must be page aligned
+ * @param bytes     The number of bytes to commit
+ * @return          True on success
+ */
+bool MemoryCommit(void *memory, size_t bytes);
+/**
+ * Gives the physical pages behind a committed range back to the OS
+ * The range stays usable. The pages will read as zero the next time they are touched
+ *
+ * @param memory    The start of the range to decommit. Must be page aligned
+ * @param bytes     The number of bytes to decommit
+ */
+void MemoryDecommit(void *memory, size_t bytes);
+/**
+ * Asks the OS to put the physical pages behind a range on a NUMA node, if it can
+ * Pages that have already been touched may stay where they are
+ *
+ * @param memory    The start of the range. Must be page aligned
+ * @param bytes     The number of bytes in the range
+ * @param node      The NUMA node. See CpuInfo::NodeId
+ * @return          True if the OS accepted the request
+ */
+bool MemoryBindToNode(void *memory, size_t bytes, unsigned node);
+
 } // End of namespace ftl
@@ -0,0 +1,55 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+
+namespace ftl {
+
+/**
+ * Asymmetric fences split the cost of a pair of seq_cst fences unevenly, for when one side runs far more often than the other
+ * The light side is only a compiler fence. The heavy side makes every running thread in the process execute a full fence
+ * A light fence paired with a heavy fence orders memory like two seq_cst fences would
+ *
+ * Linux uses membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED), and Windows uses FlushProcessWriteBuffers()
+ */
+
+/**
+ * Sets up asymmetric fences for the process. Safe to call more than once, from any thread
+ *
+ * @return    True if the OS supports them. If not, light and heavy fences don't order anything against each other
+ */
+bool EnableAsymmetricFences();
+
+inline void AsymmetricFenceLight() {
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+}
+
+/**
+ * Only valid after EnableAsymmetricFences() has returned true. This is a system call, so it costs a few microseconds
+ */
+void AsymmetricFenceHeavy();
+
+} // End of namespace ftl
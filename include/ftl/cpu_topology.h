@@ -0,0 +1,111 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <vector>
+
+namespace ftl {
+
+/* The capacity of the fastest cores. See CpuInfo::Capacity */
+constexpr unsigned kMaxCpuCapacity = 1024;
+
+/**
+ * Where a logical CPU sits in the machine
+ *
+ * The ids are only meaningful for comparing two CPUs. For example, two CPUs with the same CoreId are SMT siblings
+ */
+struct CpuInfo {
+	/* The OS's number for the CPU. This is what SetCurrentThreadAffinity() takes */
+	unsigned Id;
+	/* The physical core the CPU belongs to */
+	unsigned CoreId;
+	/* The group of cores that share a last level cache. For example, an AMD CCX */
+	unsigned CacheId;
+	/* The physical package (socket) */
+	unsigned PackageId;
+	/* The NUMA node */
+	unsigned NodeId;
+	/**
+	 * How fast the CPU is, relative to the fastest in the machine, which is kMaxCpuCapacity. On hybrid CPUs,
+	 * the efficiency cores have a lower capacity than the performance cores. Otherwise, every CPU has the same
+	 */
+	unsigned Capacity;
+};
+
+/**
+ * Reads the topology of the CPUs that are online
+ *
+ * On Linux, this comes from /sys/devices/system/cpu. Elsewhere, or if that can't be read, every CPU is
+ * treated as a separate core, all sharing one cache, package, and NUMA node, and all with the same capacity
+ *
+ * @return    The CPUs, in the order the OS numbers them
+ */
+std::vector<CpuInfo> GetCpuTopology();
+
+/**
+ * Orders CPUs to place worker threads on
+ *
+ * Physical cores come first, and SMT siblings last. So a thread pool smaller than the number of logical CPUs
+ * doesn't share cores. Within that, faster cores come first, and CPUs that share a cache, package, and NUMA node are kept
+ * next to each other
+ *
+ * @param cpus    The CPUs, as returned by GetCpuTopology()
+ * @return        The same CPUs, in the order threads should be placed on them
+ */
+std::vector<CpuInfo> OrderCpusForPlacement(std::vector<CpuInfo> cpus);
+
+/**
+ * How far apart two CPUs are, for work stealing. Stealing from a closer CPU is cheaper, since its data is more likely to be in a shared cache
+ *
+ * @param a    The first CPU
+ * @param b    The second CPU
+ * @return     0: Same core. 1: Same last level cache. 2: Same package. 3: Same NUMA node. 4: Remote
+ */
+unsigned CpuDistance(CpuInfo const &a, CpuInfo const &b);
+
+/**
+ * Gets the CPUs the calling thread is allowed to run on. Inside a container, this is the cpuset it was given
+ *
+ * @return    The OS's numbers for the CPUs, in increasing order. Every CPU from GetCpuTopology() if the OS can't tell us
+ */
+std::vector<unsigned> GetCurrentThreadAllowedCpus();
+/**
+ * Restricts the calling thread to a set of CPUs
+ *
+ * @param cpus    The OS's numbers for the CPUs
+ * @return        True on success. Always false where the OS doesn't support it
+ */
+bool SetCurrentThreadAllowedCpus(std::vector<unsigned> const &cpus);
+/**
+ * Gets how many CPUs' worth of time the process may use, from its cgroup v2 cpu.max quota
+ *
+ * A container can be given a quota of, say, 2 CPUs, while still being allowed to run on all of them. Running more
+ * threads than that just gets them throttled
+ *
+ * @return    The quota, rounded up to a whole CPU. 0 if there is no quota, or it can't be read
+ */
+unsigned GetCpuQuota();
+
+} // End of namespace ftl
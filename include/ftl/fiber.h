@@ -50,6 +50,17 @@ public:
 	 * @param arg              The argument to pass to 'startRoutine'
 	 */
 	Fiber(size_t stackSize, FiberStartRoutine startRoutine, void *arg);
+	/**
+	 * Sets up a fiber on a stack owned by the caller. The fiber will start executing 'startRoutine' when first switched to
+	 *
+	 * NOTE: The fiber does *not* free the stack. The memory must outlive the fiber
+	 *
+	 * @param stack           The lowest address of the stack memory
+	 * @param stackSize       The size of the stack memory
+	 * @param startRoutine    The function to run when the fiber first starts
+	 * @param arg             The argument to pass to 'startRoutine'
+	 */
+	Fiber(void *stack, size_t stackSize, FiberStartRoutine startRoutine, void *arg);
 
 	/**
 	 * Deleted copy constructor
@@ -90,6 +101,8 @@ public:
 
 private:
 	void *m_stack{ nullptr };
+	/* False if the stack memory was provided by the creator of the fiber */
+	bool m_ownsStack{ false };
 	size_t m_systemPageSize{ 0 };
 	size_t m_stackSize{ 0 };
 	boost_context::fcontext_t m_context{ nullptr };
@@ -97,6 +110,13 @@ private:
 	FTL_VALGRIND_ID
 
 public:
+	/**
+	 * Returns true if the fiber allocated its own stack, and false if it was given one (or has none)
+	 */
+	bool OwnsStack() const {
+		return m_ownsStack;
+	}
+
 	/**
 	 * Saves the current stack context and then switches to the given fiber
 	 * Execution will resume here once another fiber switches to this fiber
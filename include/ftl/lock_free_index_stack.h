@@ -0,0 +1,157 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "ftl/assert.h"
+#include "ftl/config.h"
+#include "ftl/ftl_valgrind.h"
+
+#include <atomic>
+#include <limits>
+#include <stdint.h>
+
+namespace ftl {
+
+/**
+ * A lock-free LIFO stack of the indices [0, capacity)
+ *
+ * This is a Treiber stack where the "nodes" are the indices themselves. The links live in a side array
+ * that is allocated once at construction, so Push() and Pop() never allocate. The head stores a
+ * version tag next to the index, so a Pop() that raced with a Pop() + Push() of the same index will
+ * fail its CAS, rather than corrupting the stack (the ABA problem)
+ *
+ * NOTE: An index must not be pushed while it is already in the stack
+ */
+class LockFreeIndexStack {
+public:
+	constexpr static unsigned kInvalidIndex = std::numeric_limits<unsigned>::max();
+
+	explicit LockFreeIndexStack(unsigned const capacity)
+	        : m_head(Pack(kInvalidIndex, 0)),
+	          m_next(new std::atomic<unsigned>[capacity]),
+	          m_capacity(capacity) {
+		for (unsigned i = 0; i < capacity; ++i) {
+			m_next[i].store(kInvalidIndex, std::memory_order_relaxed);
+		}
+
+		FTL_VALGRIND_HG_DISABLE_CHECKING(&m_head, sizeof(m_head));
+	}
+
+	LockFreeIndexStack(LockFreeIndexStack const &) = delete;
+	LockFreeIndexStack(LockFreeIndexStack &&) noexcept = delete;
+	LockFreeIndexStack &operator=(LockFreeIndexStack const &) = delete;
+	LockFreeIndexStack &operator=(LockFreeIndexStack &&) noexcept = delete;
+	~LockFreeIndexStack() {
+		delete[] m_next;
+	}
+
+private:
+	alignas(kCacheLineSize) std::atomic<uint64_t> m_head;
+	std::atomic<unsigned> *m_next;
+	unsigned m_capacity;
+
+public:
+	/**
+	 * Pushes an index onto the stack
+	 *
+	 * @param index    The index to push
+	 */
+	void Push(unsigned const index) {
+		PushChain(index, index);
+	}
+
+	/**
+	 * Pushes a group of indices onto the stack with a single CAS
+	 * After the push, indices[0] will be at the top of the stack
+	 *
+	 * @param indices    The indices to push
+	 * @param count      The number of indices
+	 */
+	void PushMany(unsigned const *indices, unsigned const count) {
+		if (count == 0) {
+			return;
+		}
+
+		// Link the group together before publishing it
+		for (unsigned i = 0; i + 1 < count; ++i) {
+			FTL_ASSERT("Index is out of range", indices[i] < m_capacity);
+			m_next[indices[i]].store(indices[i + 1], std::memory_order_relaxed);
+		}
+		PushChain(indices[0], indices[count - 1]);
+	}
+
+	/**
+	 * Pops the top index off the stack
+	 *
+	 * @param index    If the stack is not empty, will be filled with the popped index
+	 * @return         True: Successfully popped an index
+	 */
+	bool Pop(unsigned *const index) {
+		uint64_t head = m_head.load(std::memory_order_acquire);
+		while (true) {
+			unsigned const top = UnpackIndex(head);
+			if (top == kInvalidIndex) {
+				return false;
+			}
+
+			// If another thread pops `top` before our CAS, the tag will have changed, and the CAS fails
+			// So it doesn't matter if `next` is stale
+			unsigned const next = m_next[top].load(std::memory_order_relaxed);
+			if (m_head.compare_exchange_weak(head, Pack(next, UnpackTag(head) + 1), std::memory_order_acq_rel, std::memory_order_acquire)) {
+				*index = top;
+				return true;
+			}
+		}
+	}
+
+	/**
+	 * @return    True if the stack was empty at the time of the call
+	 */
+	bool Empty() const {
+		return UnpackIndex(m_head.load(std::memory_order_relaxed)) == kInvalidIndex;
+	}
+
+private:
+	void PushChain(unsigned const first, unsigned const last) {
+		FTL_ASSERT("Index is out of range", first < m_capacity && last < m_capacity);
+
+		uint64_t head = m_head.load(std::memory_order_relaxed);
+		do {
+			m_next[last].store(UnpackIndex(head), std::memory_order_relaxed);
+		} while (!m_head.compare_exchange_weak(head, Pack(first, UnpackTag(head) + 1), std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	static uint64_t Pack(unsigned const index, uint32_t const tag) {
+		return (static_cast<uint64_t>(tag) << 32) | index;
+	}
+	static unsigned UnpackIndex(uint64_t const value) {
+		return static_cast<unsigned>(value & 0xFFFFFFFF);
+	}
+	static uint32_t UnpackTag(uint64_t const value) {
+		return static_cast<uint32_t>(value >> 32);
+	}
+};
+
+} // End of namespace ftl
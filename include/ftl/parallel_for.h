@@ -27,58 +27,85 @@
 #include "ftl/task_scheduler.h"
 #include "ftl/wait_group.h"
 
+#include <iterator>
 #include <type_traits>
-#if defined(FTL_CPP_17)
-#	include <iterator>
-#endif
 
 namespace ftl {
 
 template <typename T>
 using ParallelForTaskFunction = void(TaskScheduler *taskScheduler, T *value);
 
+template <typename ItrType>
+using ParallelForChunkFunction = void(TaskScheduler *taskScheduler, ItrType begin, ItrType end);
+
+/**
+ * Calls func on contiguous chunks of [begin, end), spread over the threads
+ * The loop over each chunk is in func, where the compiler can see it. So it can be inlined and vectorized
+ *
+ * The whole range is queued as a single range task, so nothing is allocated, and the range is only split as other
+ * threads become free. See TaskScheduler::AddRangeTask(). Returns once every chunk is done
+ *
+ * @param taskScheduler    The scheduler
+ * @param begin            The start of the range. Must be a random access iterator
+ * @param end              The end of the range
+ * @param batchSize        The most elements in one chunk. 0 picks a size from the size of the range and the number of threads
+ * @param func             Called as func(taskScheduler, chunkBegin, chunkEnd). See ParallelForChunkFunction
+ * @param priority         The priority of the range task
+ */
 template <typename ItrType, typename Callable>
-void ParallelFor(TaskScheduler *taskScheduler, ItrType begin, ItrType end, size_t batchSize, Callable &&func, TaskPriority priority) {
+void ParallelForChunks(TaskScheduler *taskScheduler, ItrType begin, ItrType end, size_t batchSize, Callable &&func, TaskPriority priority) {
+	using Difference = typename std::iterator_traits<ItrType>::difference_type;
+
 	struct ParallelForArg {
-		ItrType Start = ItrType();
-		size_t Count = 0;
-		typename std::remove_reference<Callable>::type *Function = nullptr;
+		ItrType Begin;
+		typename std::remove_reference<Callable>::type *Function;
 	};
 
-	const size_t dataSize = static_cast<size_t>(std::distance(begin, end));
+	// Everything lives on this stack, and we wait for the range to finish below
+	ParallelForArg arg = { begin, &func };
 
-	const size_t numBatches = (dataSize + (batchSize - 1)) / batchSize;
-	ParallelForArg *internalArgs = new ParallelForArg[numBatches];
+	RangeTask range{};
+	range.Function = [](TaskScheduler *ts, void *arg_, size_t chunkBegin, size_t chunkEnd) {
+		ParallelForArg *argData = static_cast<ParallelForArg *>(arg_);
+		ItrType const first = argData->Begin + static_cast<Difference>(chunkBegin);
+		(*argData->Function)(ts, first, first + static_cast<Difference>(chunkEnd - chunkBegin));
+	};
+	range.ArgData = &arg;
+	range.Begin = 0;
+	range.End = static_cast<size_t>(std::distance(begin, end));
+	range.Grain = batchSize;
 
-	size_t remaining = dataSize;
 	WaitGroup wg(taskScheduler);
-	ItrType current = begin;
-	for (size_t i = 0; i < numBatches; ++i) {
-		const size_t count = remaining < batchSize ? remaining : batchSize;
-
-		ParallelForArg *wrapperArgs = &internalArgs[i];
-		wrapperArgs->Start = current;
-		wrapperArgs->Count = count;
-		wrapperArgs->Function = &func;
-
-		remaining -= count;
-		current += static_cast<typename std::iterator_traits<ItrType>::difference_type>(count);
-
-		Task wrapperTask{};
-		wrapperTask.ArgData = wrapperArgs;
-		wrapperTask.Function = [](TaskScheduler *ts, void *arg_) {
-			ParallelForArg *argData = static_cast<ParallelForArg *>(arg_);
-			size_t j = 0;
-			ItrType iter = argData->Start;
-			for (; j < argData->Count; ++j, ++iter) {
-				(*argData->Function)(ts, &(*iter));
-			}
-		};
-		taskScheduler->AddTask(wrapperTask, priority, &wg);
-	}
-
+	taskScheduler->AddRangeTask(&range, priority, &wg);
 	wg.Wait();
-	delete[] internalArgs;
+}
+
+template <typename T, typename Callable>
+void ParallelForChunks(TaskScheduler *taskScheduler, T *data, size_t dataSize, size_t batchSize, Callable &&func, TaskPriority priority) {
+	ParallelForChunks(taskScheduler, data, data + dataSize, batchSize, func, priority);
+}
+
+template <typename Iterable, typename Callable>
+void ParallelForChunks(TaskScheduler *taskScheduler, Iterable &&iterable, size_t batchSize, Callable &&func, TaskPriority priority) {
+	ParallelForChunks(taskScheduler, iterable.begin(), iterable.end(), batchSize, func, priority);
+}
+
+/**
+ * Calls func on every element of [begin, end), spread over the threads. See ParallelForChunks()
+ *
+ * @param func    Called as func(taskScheduler, &element). See ParallelForTaskFunction
+ */
+template <typename ItrType, typename Callable>
+void ParallelFor(TaskScheduler *taskScheduler, ItrType begin, ItrType end, size_t batchSize, Callable &&func, TaskPriority priority) {
+	ParallelForChunks(
+	    taskScheduler, begin, end, batchSize,
+	    [&func](TaskScheduler *ts, ItrType chunkBegin, ItrType chunkEnd) {
+		    for (ItrType iter = chunkBegin; iter != chunkEnd; ++iter) {
+			    func(ts, &(*iter));
+		    }
+	    },
+	    priority
+	);
 }
 
 template <typename T, typename Callable>
@@ -87,7 +114,7 @@ void ParallelFor(TaskScheduler *taskScheduler, T *data, size_t dataSize, size_t
 }
 
 template <typename Iterable, typename Callable>
-void ParallelFor(TaskScheduler *taskScheduler, Iterable iterable, size_t batchSize, Callable &&func, TaskPriority priority) {
+void ParallelFor(TaskScheduler *taskScheduler, Iterable &&iterable, size_t batchSize, Callable &&func, TaskPriority priority) {
 	ParallelFor(taskScheduler, iterable.begin(), iterable.end(), batchSize, func, priority);
 }
 
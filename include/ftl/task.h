@@ -24,6 +24,8 @@
 
 #pragma once
 
+#include <stddef.h>
+
 namespace ftl {
 
 class TaskScheduler;
@@ -35,6 +37,21 @@ struct Task {
 	void *ArgData;
 };
 
+using RangeTaskFunction = void (*)(TaskScheduler *taskScheduler, void *arg, size_t begin, size_t end);
+
+/**
+ * A task over the indices [Begin, End). Function is called on one chunk of the range at a time, and the range is split
+ * between threads as they run out of work. See TaskScheduler::AddRangeTask()
+ */
+struct RangeTask {
+	RangeTaskFunction Function;
+	void *ArgData;
+	size_t Begin;
+	size_t End;
+	/* The most indices Function is called with at once. 0 picks one from the size of the range and the number of threads */
+	size_t Grain;
+};
+
 enum class TaskPriority {
 	High,
 	Normal,
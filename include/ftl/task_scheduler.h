@@ -25,14 +25,16 @@
 #pragma once
 
 #include "ftl/callbacks.h"
+#include "ftl/cpu_topology.h"
 #include "ftl/fiber.h"
+#include "ftl/lock_free_index_stack.h"
 #include "ftl/task.h"
 #include "ftl/thread_abstraction.h"
+#include "ftl/thread_parker.h"
 #include "ftl/wait_free_queue.h"
 #include "ftl/wait_group.h"
 
 #include <atomic>
-#include <condition_variable>
 #include <mutex>
 #include <vector>
 
@@ -44,21 +46,142 @@ enum class EmptyQueueBehavior {
 	// Same as spin, except yields to the OS after each round of searching
 	Yield,
 	// Puts the thread to sleep. Will be woken when more tasks are added to the remaining awake threads.
-	Sleep
+	Sleep,
+	// Spins for a while, then yields, then sleeps. Each thread learns how long to spin from how long it
+	// usually waits for work, and how long it takes to wake up from sleep
+	Adaptive
 	// ReSharper restore CppInconsistentNaming
 };
 
+enum class StealPolicy {
+	// Start with the thread we last stole from successfully, then try each of the others in turn
+	Sequential,
+	// Try the other threads in a random order. Keeps the thieves from all piling onto the same thread
+	Random,
+	// Pick two other threads at random, and try the one with more work queued
+	PowerOfTwoChoices,
+	// Try the threads on the same core first, then the same last level cache, then the same package, then the same NUMA node,
+	// and only then the rest. Stolen tasks are more likely to find their data in a shared cache. With a small MaxStealAttempts,
+	// each round that finds nothing moves further out, and wraps back round to the closest
+	Hierarchical
+};
+
+enum class ThreadPinning {
+	// Pin each thread to its own CPU, out of the ones the process is allowed to use. Physical cores first. See OrderCpusForPlacement()
+	Topology,
+	// Pin the threads to the CPUs in TaskSchedulerInitOptions::AffinityCpus, in that order
+	CpuList,
+	// Don't pin the threads. The OS is free to move them between any of the CPUs the process is allowed to use
+	None
+};
+
+struct ThreadPriorityOptions {
+	/* The OS scheduling policy. See SetCurrentThreadPriority() */
+	ThreadSchedulingPolicy Policy = ThreadSchedulingPolicy::Normal;
+	/* A nice value for ThreadSchedulingPolicy::Normal, or a real-time priority otherwise */
+	int Priority = 0;
+};
+
+struct FiberStackClassOptions {
+	/* The size of each fiber's stack in this class, in bytes */
+	size_t StackSize = 524288;
+	/* The number of fibers of this class to create up front */
+	unsigned PoolSize = 0;
+	/* The size this class is allowed to grow to, if it runs out of fibers. Must be > 0 if PoolSize is 0 */
+	unsigned MaxPoolSize = 0;
+};
+
 struct TaskSchedulerInitOptions {
-	/* The size of the fiber pool.The fiber pool is used to run new tasks when the current task is waiting on a counter */
+	/* The size of the fiber pool.The fiber pool is used to run new tasks when the current task is waiting on a counter. Must be > 0, since the main thread fiber takes the first slot */
 	unsigned FiberPoolSize = 400;
-	/* The size of the thread pool to run. 0 corresponds to NumHardwareThreads() */
+	/* The size the fiber pool is allowed to grow to, if it runs out of fibers. 0 (or anything <= FiberPoolSize) means the pool never grows */
+	unsigned MaxFiberPoolSize = 0;
+	/* The number of fibers to create each time the pool grows */
+	unsigned FiberPoolGrowthSize = 32;
+	/* If the pool has grown, free idle fibers until it is back to FiberPoolSize once it hasn't run out of fibers for this many milliseconds. 0 means never shrink */
+	unsigned FiberPoolTrimDelayMs = 0;
+	/* The size of each fiber's stack, in bytes. Stacks are only backed by physical memory as they are touched */
+	size_t FiberStackSize = 524288;
+	/* When a fiber that waited with its stack deeper than this many bytes goes back to the pool, the deeper part is given back to the OS. 0 means never */
+	size_t FiberStackRetainSize = 65536;
+	/**
+	 * Extra fiber pools with bigger stacks, for tasks that need them. See the stackClass argument of AddTask()
+	 * The pool described by FiberPoolSize, MaxFiberPoolSize and FiberStackSize is stack class 0. These are classes 1, 2, ...
+	 * Each class must have a bigger StackSize than the one before it
+	 */
+	std::vector<FiberStackClassOptions> ExtraFiberStackClasses;
+	/**
+	 * The size of the thread pool to run. 0 means one thread for each CPU the threads can use. That's the AffinityCpus
+	 * for ThreadPinning::CpuList. Otherwise, it's the CPUs the calling thread is allowed to run on. Either way, it's capped by
+	 * the process's cgroup CPU quota. See GetCurrentThreadAllowedCpus() and GetCpuQuota()
+	 */
 	unsigned ThreadPoolSize = 0;
+	/* How to place the threads on CPUs. Thread i goes on the i'th CPU, wrapping around if there are more threads than CPUs */
+	ThreadPinning Pinning = ThreadPinning::Topology;
+	/* The CPUs to pin the threads to, for ThreadPinning::CpuList. Thread 0 is the thread that calls Init(). Must not be empty for ThreadPinning::CpuList */
+	std::vector<unsigned> AffinityCpus;
+	/**
+	 * The OS scheduling policy and priority for the worker threads. The thread that calls Init() is left as it is
+	 * If the process doesn't have the privilege, the threads keep the default policy. See ThreadPrioritiesApplied()
+	 * Real-time threads should use EmptyQueueBehavior::Sleep or Adaptive. A real-time thread that spins or yields can starve
+	 * the other threads on its CPU
+	 */
+	ThreadPriorityOptions WorkerPriority;
+	/* The same, for worker threads on the efficiency cores of a hybrid CPU. See CpuInfo::Capacity */
+	ThreadPriorityOptions EfficiencyWorkerPriority;
 	/* The behavior of the threads after they have no work to do */
 	EmptyQueueBehavior Behavior = EmptyQueueBehavior::Spin;
+	/**
+	 * The maximum number of threads that can look for work in other threads' queues at once. The rest go to sleep
+	 * until there is work for them, whatever the Behavior. This stops large thread pools from all hammering each other's queues
+	 * 0 means no limit
+	 */
+	unsigned MaxSpinningThreads = 0;
+	/**
+	 * AddTasks() batches of at least this many tasks are split evenly between all the threads, rather than all going on the calling
+	 * thread's queue. So the other threads can start on them right away, instead of stealing them one at a time. 0 means never split
+	 */
+	unsigned SpreadTasksThreshold = 1024;
+	/**
+	 * The number of worker threads to keep for TaskPriority::High tasks and ready fibers. They never run TaskPriority::Normal
+	 * tasks, so they're never stuck in the middle of a long one when urgent work shows up. They're threads 1, 2, ..., which are
+	 * placed on the fastest cores. Capped at ThreadPoolSize - 1, since the thread that calls Init() is never reserved
+	 */
+	unsigned ReservedHighPriorityThreads = 0;
+	/* How a thread that has run out of work picks which other threads to steal from */
+	StealPolicy VictimSelection = StealPolicy::Sequential;
+	/**
+	 * The most threads to try stealing from each time a thread looks for work. On large thread pools, a full scan can
+	 * cost more than the task it finds. If a thread finds nothing, it tries the next ones along the time after, so it
+	 * still reaches every thread eventually. 0 means try all of them
+	 */
+	unsigned MaxStealAttempts = 0;
+	/**
+	 * Take the full fence out of a thread popping its own queues, and make stealing threads pay for it with a heavy, process
+	 * wide fence instead. See WaitFreeQueue. A heavy fence is a system call that interrupts every CPU running one of the
+	 * process's threads, so this is only a win if steals are rare compared to local pops
+	 * Ignored if the OS doesn't support it. See AsymmetricQueueFences()
+	 */
+	bool AsymmetricQueueFences = false;
 	/* Callbacks to run at various points to allow for e.g. hooking a profiler to fiber states */
 	EventCallbacks Callbacks;
 };
 
+struct FiberPoolStats {
+	/* The number of fibers that currently have a stack allocated. This includes the main thread fiber */
+	unsigned CommittedFibers;
+	/* The highest value CommittedFibers has reached */
+	unsigned PeakCommittedFibers;
+	/* The number of times the pool has grown */
+	unsigned GrowthCount;
+	/* The total number of fibers created by growing the pool */
+	unsigned FibersGrown;
+	/* The number of times idle fibers were trimmed */
+	unsigned TrimCount;
+	/* The total number of fibers freed by trimming */
+	unsigned FibersTrimmed;
+};
+
 struct WaitingFiberBundle;
 
 /**
@@ -78,6 +201,17 @@ public:
 	~TaskScheduler();
 
 private:
+	/* The maximum number of free fibers each thread can stash in ThreadLocalStorage::FiberCache */
+	constexpr static unsigned kFiberCacheCapacity = 16;
+	/* The number of tasks each of a thread's task queues can hold. The rest spill to m_hiPriOverflow / m_loPriOverflow */
+	constexpr static size_t kTaskQueueCapacity = 512;
+	/* The number of fibers a thread's ready fiber queue can hold. The rest spill to m_readyFiberOverflow */
+	constexpr static size_t kReadyFiberQueueCapacity = 256;
+	/* The most halves one run of a range task can split off. They're kept on its fiber stack. See RunRangeTask() */
+	constexpr static unsigned kMaxRangeSplits = 16;
+	/* With RangeTask::Grain 0, the range is cut into about this many chunks per thread */
+	constexpr static size_t kRangeTaskChunksPerThread = 32;
+
 	// Inner struct definitions
 
 	enum class FiberDestination {
@@ -93,25 +227,116 @@ private:
 	struct TaskBundle {
 		Task TaskToExecute;
 		WaitGroup *WG;
+		/* The smallest stack class the task can run on */
+		unsigned StackClass;
+	};
+
+	/**
+	 * Where pushes go when the thread's own queue is full. It's shared by all the threads, so it needs a lock. But it's
+	 * only used when a thread has a lot of work queued, so it's off the usual path
+	 * Items is used as a FIFO from Head. It's only cleared once it's drained, so it keeps its memory. Once it has grown
+	 * big enough, spilling doesn't allocate either
+	 */
+	template <typename T>
+	struct OverflowQueue {
+		std::mutex Lock;
+		std::vector<T> Items;
+		size_t Head{ 0 };
+		/* The number of items left. Can be read without the lock, to check if there's anything to take */
+		std::atomic<size_t> Size{ 0 };
+	};
+
+	/**
+	 * The second half of a range task, split off by the thread running the first half. It's queued as an ordinary task,
+	 * and lives on the splitting fiber's stack, which waits for it. See RunRangeTask()
+	 */
+	struct RangeSplit {
+		RangeTask *Range;
+		size_t Begin;
+		size_t End;
+		size_t Grain;
+		TaskPriority Priority;
+		/* Set by whoever runs the split. Either a thief, or the splitting thread once it has finished its own half */
+		std::atomic<bool> Claimed;
+	};
+
+	/**
+	 * A pool of fibers that all have the same stack size
+	 * Each class owns a contiguous range of m_fibers, and carves its stacks out of its own address space reservation
+	 */
+	struct FiberStackClass {
+		FiberStackClass() = default;
+		FiberStackClass(FiberStackClass const &) = delete;
+		FiberStackClass &operator=(FiberStackClass const &) = delete;
+
+		/* The first index in m_fibers that belongs to this class */
+		unsigned FirstFiberIndex{ 0 };
+		/* The number of fibers the class keeps, even when trimming */
+		unsigned MinFibers{ 0 };
+		/* The number of slots of m_fibers that belong to this class. The class can never have more fibers than this */
+		unsigned MaxFibers{ 0 };
+
+		/* The size of each stack, rounded up to the page size */
+		size_t StackSize{ 0 };
+		/* The distance between two stacks in StackArena. Each stack has a guard page below it */
+		size_t StackStride{ 0 };
+		/**
+		 * A single address space reservation that the stacks are carved out of, one StackStride per slot
+		 * The guard pages are never committed, so they're free. nullptr if the reservation failed,
+		 * in which case each fiber allocates its own stack
+		 */
+		char *StackArena{ nullptr };
+		size_t StackArenaSize{ 0 };
+
+		/* The free fibers of this class, stored as indices into m_fibers */
+		LockFreeIndexStack *FreeFibers{ nullptr };
+
+		/* The time (steady_clock, in ns) when the class last ran out of fibers */
+		std::atomic<int64_t> LastExhaustion{ 0 };
+		std::atomic<unsigned> CommittedFibers{ 0 };
+
+		// These are protected by m_fiberPoolLock
+
+		/* The number of slots of this class that have been used, starting from FirstFiberIndex */
+		unsigned SlotsUsed{ 0 };
+		/* Fibers whose stack was freed by trimming. These slots are re-used before growing into new ones */
+		std::vector<unsigned> TrimmedFibers;
+		FiberPoolStats Stats{};
 	};
 
 	struct alignas(kCacheLineSize) ThreadLocalStorage {
-		ThreadLocalStorage()
-		        : CurrentFiberIndex(kInvalidIndex), OldFiberIndex(kInvalidIndex) {
+		explicit ThreadLocalStorage(bool const asymmetricFences)
+		        : HiPriTaskQueue(asymmetricFences),
+		          LoPriTaskQueue(asymmetricFences),
+		          ReadyFibers(asymmetricFences),
+		          CurrentFiberIndex(kInvalidIndex),
+		          OldFiberIndex(kInvalidIndex) {
 		}
 
 	public:
 		// NOTE: The order of these variables may seem odd / jumbled. However, it is to optimize the padding required
 
-		/* The queue of high priority waiting tasks. This also contains the ready waiting fibers, which are differentiated by the Task function == ReadyFiberDummyTask */
-		WaitFreeQueue<TaskBundle> HiPriTaskQueue;
+		// The queues are fixed size, and stored inline, so pushing never allocates. See PushOrSpill()
+
+		/* The queue of high priority waiting tasks */
+		WaitFreeQueue<TaskBundle, kTaskQueueCapacity> HiPriTaskQueue;
 		/* The queue of high priority waiting tasks */
-		WaitFreeQueue<TaskBundle> LoPriTaskQueue;
+		WaitFreeQueue<TaskBundle, kTaskQueueCapacity> LoPriTaskQueue;
+
+		/**
+		 * The queue of ready waiting fibers that aren't pinned to a thread. Other threads steal from it like the task queues
+		 * Fibers are only pushed once they have been switched away from, so they can be resumed immediately
+		 */
+		WaitFreeQueue<WaitingFiberBundle *, kReadyFiberQueueCapacity> ReadyFibers;
 
-		std::atomic<bool> *OldFiberStoredFlag{ nullptr };
+		/* The wait bundle of OldFiber, if OldFiberDestination == ToWaiting */
+		WaitingFiberBundle *OldFiberBundle{ nullptr };
 
-		/* The queue of ready waiting Fibers that were pinned to this thread */
-		std::vector<WaitingFiberBundle *> PinnedReadyFibers;
+		/**
+		 * The ready waiting fibers that are pinned to this thread, in the order they were readied
+		 * This is private to the thread. It is refilled from PinnedReadyFibersHead when it runs dry
+		 */
+		WaitingFiberBundle *PinnedReadyFibers{ nullptr };
 
 		/**
 		 * The current fiber implementation requires that fibers created from threads finish on the same thread where
@@ -124,9 +349,6 @@ private:
 		 */
 		Fiber ThreadFiber;
 
-		/* Lock protecting access to PinnedReadyFibers */
-		std::mutex PinnedReadyFibersLock;
-
 		/* The index of the current fiber in m_fibers */
 		unsigned CurrentFiberIndex;
 		/* The index of the previously executed fiber in m_fibers */
@@ -134,12 +356,81 @@ private:
 		/* Where OldFiber should be stored when we call CleanUpPoolAndWaiting() */
 		FiberDestination OldFiberDestination{ FiberDestination::None };
 
+		/* The last ready fiber queue that we successfully stole from */
+		unsigned ReadyLastSuccessfulSteal{ 1 };
 		/* The last high priority queue that we successfully stole from. This is an offset index from the current thread index */
 		unsigned HiPriLastSuccessfulSteal{ 1 };
 		/* The last low priority queue that we successfully stole from. This is an offset index from the current thread index */
 		unsigned LoPriLastSuccessfulSteal{ 1 };
 
+		/**
+		 * How far along the other threads to start trying to steal from. When we can't try them all at once, each round that
+		 * finds nothing moves on to the ones we didn't get to. Reset when we steal something. See ChooseStealVictim()
+		 */
+		unsigned StealWindowOffset{ 0 };
+
 		unsigned FailedQueuePopAttempts{ 0 };
+		/* The state of the random number generator used to pick threads to steal from. Must not be 0 */
+		uint32_t StealRandomState{ 1 };
+		/* The NUMA node of the CPU the thread is pinned to */
+		unsigned NodeId{ 0 };
+		/**
+		 * True if the thread is pinned to an efficiency core of a hybrid CPU. It leaves other threads' ready fibers and
+		 * high priority tasks to the performance cores, and is the last to be woken for new work
+		 */
+		bool Efficiency{ false };
+		/* True if the thread only runs high priority tasks and ready fibers. See TaskSchedulerInitOptions::ReservedHighPriorityThreads */
+		bool HighPriorityOnly{ false };
+
+		/* Used to put the thread to sleep in EmptyQueueBehavior::Sleep and Adaptive modes */
+		ThreadParker Parker;
+		/* True while the thread's index is in m_idleThreads (or m_idleEfficiencyThreads). A thread can be on the stack and awake, if it found work before it was woken */
+		std::atomic<bool> InIdleStack{ false };
+		/* True if the thread counts towards m_spinningThreads */
+		bool Spinning{ false };
+
+		// EmptyQueueBehavior::Adaptive state. See AdaptiveIdle()
+
+		/* When (steady_clock, in ns) the thread last failed to find work. 0 if the thread isn't idle */
+		int64_t IdleStartNs{ 0 };
+		/* When the thread that woke us from our last sleep asked us to wake up. 0 if we haven't slept this idle period */
+		int64_t WokenAtNs{ 0 };
+		/* The moving average of how long the thread is idle for, capped to a multiple of AdaptiveWakeLatencyNs */
+		int64_t AdaptiveIdleNs{ 25000 };
+		/* The moving average of how long it takes from a wake up request to the thread finding work */
+		int64_t AdaptiveWakeLatencyNs{ 50000 };
+		/* How long to spin before yielding. After the same amount of time yielding, the thread goes to sleep */
+		int64_t AdaptiveSpinBudgetNs{ 50000 };
+
+		/* The number of valid entries in FiberCache */
+		unsigned FiberCacheSize{ 0 };
+		/**
+		 * A small thread-private stash of free fibers. Fibers freed on this thread are put here first, and
+		 * fibers are taken from here first. So most fiber acquisitions never touch the shared pool
+		 */
+		unsigned FiberCache[kFiberCacheCapacity];
+
+		/**
+		 * A task that needs a bigger stack than the fiber that found it. The fiber hands it to a fiber of
+		 * the right class, which runs it first thing. TaskToExecute.Function is nullptr if there is none
+		 */
+		TaskBundle HandoffTask{};
+
+		/**
+		 * The ready waiting fibers that other threads have pinned to this thread, newest first
+		 * An intrusive lock-free stack, linked through WaitingFiberBundle::Next. Any thread can push, and
+		 * this thread takes the whole list at once. It's on its own cache line, since the other threads write to it
+		 */
+		alignas(kCacheLineSize) std::atomic<WaitingFiberBundle *> PinnedReadyFibersHead{ nullptr };
+		/**
+		 * Shares of large AddTasks() batches that other threads have given to this thread. Any thread can push
+		 * If this thread is busy, idle threads can take them from it. They're always taken all at once
+		 * Their memory is reserved up front, so handing a share over doesn't allocate. See CreateThreadLocalStorage()
+		 */
+		alignas(kCacheLineSize) OverflowQueue<TaskBundle> IncomingHiPriTasks;
+		OverflowQueue<TaskBundle> IncomingLoPriTasks;
+		/* When (steady_clock, in ns) another thread last asked this thread to wake up */
+		std::atomic<int64_t> WakeRequestNs{ 0 };
 	};
 
 private:
@@ -153,29 +444,96 @@ private:
 	unsigned m_numThreads{ 0 };
 	ThreadType *m_threads{ nullptr };
 
-	unsigned m_fiberPoolSize{ 0 };
-	/* The backing storage for the fiber pool */
+	/* The number of fibers to create each time a stack class grows */
+	unsigned m_fiberPoolGrowthSize{ 0 };
+	/* The time a stack class must go without running out of fibers before we trim it. 0 means never */
+	int64_t m_fiberPoolTrimDelayNs{ 0 };
+	/* The number of bytes at the top of each stack that are kept when a fiber goes back to the pool */
+	size_t m_fiberStackRetainSize{ 0 };
+	/**
+	 * The backing storage for all the fiber pools. The stack classes split it into contiguous ranges
+	 * Only the slots a class has grown into have ever been created
+	 */
 	Fiber *m_fibers{ nullptr };
 	/**
-	 * An array of atomics, which signify if a fiber is available to be used. The indices of m_waitingFibers
-	 * correspond 1 to 1 with m_fibers. So, if m_freeFibers[i] == true, then m_fibers[i] can be used.
-	 * Each atomic acts as a lock to ensure that threads do not try to use the same fiber at the same time
+	 * One per slot of m_fibers. True if the fiber waited with its stack deeper than m_fiberStackRetainSize since it last went
+	 * back to the pool. Only ever touched by the thread running the fiber, or the one returning it to the pool
+	 */
+	bool *m_deepFibers{ nullptr };
+	unsigned m_fiberSlotCount{ 0 };
+	/* The fiber pools, in order of increasing stack size. Class 0 also contains the main fiber, at index 0 */
+	FiberStackClass *m_stackClasses{ nullptr };
+	unsigned m_numStackClasses{ 0 };
+	/**
+	 * How many class 0 fibers each thread is allowed to keep in its FiberCache
+	 * This is scaled down for small pools, so the caches can't starve the other threads
 	 */
-	std::atomic<bool> *m_freeFibers{ nullptr };
+	unsigned m_fiberCacheCapacity{ 0 };
+	/**
+	 * Protects growing and trimming the pools, and the parts of FiberStackClass that aren't atomic
+	 * Neither happen in the steady state, so a lock is fine here
+	 */
+	std::mutex m_fiberPoolLock;
+
+	/* Tasks and ready fibers that didn't fit in the queues of the thread that pushed them. Any thread can take them */
+	OverflowQueue<TaskBundle> m_hiPriOverflow;
+	OverflowQueue<TaskBundle> m_loPriOverflow;
+	OverflowQueue<WaitingFiberBundle *> m_readyFiberOverflow;
 
 	Fiber *m_quitFibers{ nullptr };
 
 	std::atomic<bool> m_initialized{ false };
+	/* Init() failed after creating some of the worker threads. They exit without ever starting a fiber */
+	std::atomic<bool> m_initAborted{ false };
 	std::atomic<bool> m_quit{ false };
 	std::atomic<unsigned> m_quitCount{ 0 };
 
 	std::atomic<EmptyQueueBehavior> m_emptyQueueBehavior{ EmptyQueueBehavior::Spin };
 	/**
-	 * This lock is used with the CV below to put threads to sleep when there
-	 * is no work to do.
+	 * The threads that are asleep (or about to be) in EmptyQueueBehavior::Sleep and Adaptive modes
+	 * Adding work pops as many threads as it needs off here, and wakes just those. See ParkCurrentThread()
 	 */
-	std::mutex ThreadSleepLock;
-	std::condition_variable ThreadSleepCV;
+	LockFreeIndexStack *m_idleThreads{ nullptr };
+	/* The same, for the threads on efficiency cores. They're only woken once m_idleThreads is empty. See ThreadLocalStorage::Efficiency */
+	LockFreeIndexStack *m_idleEfficiencyThreads{ nullptr };
+	/* The same, for the threads reserved for high priority work. They're only woken for that. See ThreadLocalStorage::HighPriorityOnly */
+	LockFreeIndexStack *m_idleReservedThreads{ nullptr };
+	/* See TaskSchedulerInitOptions::ReservedHighPriorityThreads */
+	unsigned m_numReservedThreads{ 0 };
+	/* The most threads allowed to steal work at once. 0 means no limit. See StartSpinning() */
+	unsigned m_maxSpinningThreads{ 0 };
+	/* AddTasks() batches this big or bigger are split between the threads. 0 means never. See AddTasks() */
+	unsigned m_spreadTasksThreshold{ 0 };
+	/* How threads pick which other threads to steal from. See ChooseStealVictim() */
+	StealPolicy m_victimSelection{ StealPolicy::Sequential };
+	/* The number of threads to try stealing from each time a thread looks for work. Always < m_numThreads */
+	unsigned m_stealAttempts{ 0 };
+	/* The CPU each thread is pinned to. If the threads aren't pinned, where they would be. It's still used to pick who to steal from */
+	std::vector<CpuInfo> m_threadCpus;
+	/* False for ThreadPinning::None */
+	bool m_pinThreads{ true };
+	/* The highest Capacity in m_threadCpus. Threads on slower CPUs are on efficiency cores */
+	unsigned m_maxThreadCapacity{ kMaxCpuCapacity };
+	/* See TaskSchedulerInitOptions::WorkerPriority and EfficiencyWorkerPriority */
+	ThreadPriorityOptions m_workerPriority;
+	ThreadPriorityOptions m_efficiencyWorkerPriority;
+	/* Set by any worker thread that couldn't get the policy it asked for */
+	std::atomic<bool> m_threadPriorityFailed{ false };
+	/* See TaskSchedulerInitOptions::AsymmetricQueueFences. Only true if the OS supports them */
+	bool m_asymmetricQueueFences{ false };
+	/* The CPUs the main thread was allowed to run on before Init() pinned it. The destructor puts it back */
+	std::vector<unsigned> m_mainThreadCpus;
+	/* True if the threads are spread over more than one NUMA node. Memory is only placed explicitly if so */
+	bool m_multipleNodes{ false };
+	/**
+	 * For StealPolicy::Hierarchical. The other threads, closest first, for each thread in turn
+	 * Thread i's list is m_stealOrder[i * (m_numThreads - 1)] to m_stealOrder[(i + 1) * (m_numThreads - 1) - 1]
+	 */
+	std::vector<unsigned> m_stealOrder;
+	/* The number of threads currently allowed to steal work */
+	std::atomic<unsigned> m_spinningThreads{ 0 };
+	/* The number of threads asleep in ParkCurrentThread() */
+	std::atomic<unsigned> m_parkedThreads{ 0 };
 
 	/**
 	 * c++ Thread Local Storage is, by definition, static/global. This poses some problems, such as multiple
@@ -184,8 +542,12 @@ private:
 	 *
 	 * During initialization of the TaskScheduler, we create one ThreadLocalStorage instance per thread. Threads index
 	 * into their storage using m_tls[GetCurrentThreadIndex()]
+	 *
+	 * Each thread creates its own, so it lives on the thread's NUMA node. See CreateThreadLocalStorage()
 	 */
-	ThreadLocalStorage *m_tls{ nullptr };
+	ThreadLocalStorage **m_tls{ nullptr };
+	/* The number of threads that have created their ThreadLocalStorage. Init() waits for all of them */
+	std::atomic<unsigned> m_tlsCreated{ 0 };
 
 	/**
 	 * We friend WaitGroup and Fibtex so we can keep InitWaitingFiberBundle() and SwitchToFreeFiber() private
@@ -204,6 +566,8 @@ public:
 	 * @return           0 on sucess. One of the following error code on failure:
 	 *                       -30  Init was called more than once
 	 *                       -60  Failed to create worker threads
+	 *                       -70  The fiber stack classes are invalid
+	 *                       -80  Pinning is ThreadPinning::CpuList, but AffinityCpus is empty
 	 */
 	int Init(TaskSchedulerInitOptions options = TaskSchedulerInitOptions());
 
@@ -212,24 +576,42 @@ public:
 	 *
 	 * NOTE: This can *only* be called from the main thread or inside tasks on the worker threads
 	 *
-	 * @param task        The task to queue
-	 * @param priority    Which priority queue to put the task in
-	 * @param counter     An atomic counter corresponding to this task. Initially it will be incremented by 1. When the task
-	 *                    completes, it will be decremented.
+	 * @param task          The task to queue
+	 * @param priority      Which priority queue to put the task in
+	 * @param counter       An atomic counter corresponding to this task. Initially it will be incremented by 1. When the task
+	 *                      completes, it will be decremented.
+	 * @param stackClass    The smallest fiber stack class the task may run on. See TaskSchedulerInitOptions::ExtraFiberStackClasses
 	 */
-	void AddTask(Task task, TaskPriority priority, WaitGroup *waitGroup = nullptr);
+	void AddTask(Task task, TaskPriority priority, WaitGroup *waitGroup = nullptr, unsigned stackClass = 0);
 	/**
 	 * Adds a group of tasks to the internal queue
 	 *
 	 * NOTE: This can *only* be called from the main thread or inside tasks on the worker threads
 	 *
-	 * @param numTasks    The number of tasks
-	 * @param tasks       The tasks to queue
-	 * @param priority    Which priority queue to put the tasks in
-	 * @param counter     An atomic counter corresponding to the task group as a whole. Initially it will be incremented by
-	 *                    numTasks. When each task completes, it will be decremented.
+	 * @param numTasks      The number of tasks
+	 * @param tasks         The tasks to queue
+	 * @param priority      Which priority queue to put the tasks in
+	 * @param counter       An atomic counter corresponding to the task group as a whole. Initially it will be incremented by
+	 *                      numTasks. When each task completes, it will be decremented.
+	 * @param stackClass    The smallest fiber stack class the tasks may run on. See TaskSchedulerInitOptions::ExtraFiberStackClasses
+	 */
+	void AddTasks(uint32_t numTasks, Task *tasks, TaskPriority priority, WaitGroup *waitGroup = nullptr, unsigned stackClass = 0);
+	/**
+	 * Adds a task over a range of indices. However big the range, it's queued as a single task
+	 *
+	 * The thread that runs it calls RangeTask::Function on one chunk at a time. Whenever that thread's queue is empty, it
+	 * queues the second half of what's left of the range as a new task, for another thread to steal, and carries on with
+	 * the first half. Halves that nobody steals are run by the thread that split them off. So the range is only split
+	 * as far as there are threads to take the pieces (lazy binary splitting)
+	 *
+	 * NOTE: This can *only* be called from the main thread or inside tasks on the worker threads
+	 *
+	 * @param task         The range task. It's not copied, so it must stay alive until waitGroup is done
+	 * @param priority     Which priority queue to put the task, and its splits, in
+	 * @param waitGroup    An atomic counter corresponding to the whole range. Initially it will be incremented by 1. When every
+	 *                     index in the range has been processed, it will be decremented
 	 */
-	void AddTasks(uint32_t numTasks, Task *tasks, TaskPriority priority, WaitGroup *waitGroup = nullptr);
+	void AddRangeTask(RangeTask *task, TaskPriority priority, WaitGroup *waitGroup = nullptr);
 
 	/**
 	 * Gets the 0-based index of the current thread
@@ -237,6 +619,8 @@ public:
 	 *
 	 * NOTE: This can *only* be called from the main thread or inside tasks on the worker threads
 	 *
+	 * This is O(1). Each thread stores its index in a thread_local slot when it binds to the TaskScheduler
+	 *
 	 * We force no-inline because inlining seems to cause some tls-type caching on max optimization levels
 	 * Discovered by @cwfitzgerald. Documented in issue #57
 	 *
@@ -251,6 +635,26 @@ public:
 	 */
 	unsigned GetCurrentFiberIndex() const;
 
+	/**
+	 * Checks whether every worker thread got the scheduling policy and priority it asked for
+	 * See TaskSchedulerInitOptions::WorkerPriority
+	 *
+	 * @return    False if any of them were left with the default, for example because the process lacks the privilege
+	 */
+	bool ThreadPrioritiesApplied() const noexcept {
+		return !m_threadPriorityFailed.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Checks whether the task and ready fiber queues use asymmetric fences
+	 * See TaskSchedulerInitOptions::AsymmetricQueueFences
+	 *
+	 * @return    False if they weren't asked for, or the OS doesn't support them
+	 */
+	bool AsymmetricQueueFences() const noexcept {
+		return m_asymmetricQueueFences;
+	}
+
 	/**
 	 * Gets the amount of backing threads.
 	 *
@@ -261,14 +665,54 @@ public:
 	}
 
 	/**
-	 * Gets the amount of fibers in the fiber pool.
+	 * Gets the number of threads currently looking for work in the other threads' queues.
+	 * Only tracked if TaskSchedulerInitOptions::MaxSpinningThreads is set. Otherwise it's always 0
+	 *
+	 * @return    Spinning thread count
+	 */
+	unsigned GetSpinningThreadCount() const noexcept {
+		return m_spinningThreads.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Gets the number of threads currently asleep, waiting for work to be added.
+	 *
+	 * @return    Parked thread count
+	 */
+	unsigned GetParkedThreadCount() const noexcept {
+		return m_parkedThreads.load(std::memory_order_relaxed);
+	}
+
+	/**
+	 * Gets the amount of fibers in the fiber pool, over all the stack classes.
 	 *
 	 * @return    Fiber pool size
 	 */
 	unsigned GetFiberCount() const noexcept {
-		return m_fiberPoolSize;
+		unsigned count = 0;
+		for (unsigned i = 0; i < m_numStackClasses; ++i) {
+			count += m_stackClasses[i].CommittedFibers.load(std::memory_order_relaxed);
+		}
+		return count;
+	}
+
+	/**
+	 * Gets the number of fiber stack classes. See TaskSchedulerInitOptions::ExtraFiberStackClasses
+	 *
+	 * @return    The number of stack classes
+	 */
+	unsigned GetFiberStackClassCount() const noexcept {
+		return m_numStackClasses;
 	}
 
+	/**
+	 * Gets the growth / trim counters of the fiber pool of a stack class
+	 *
+	 * @param stackClass    The stack class
+	 * @return              A snapshot of the fiber pool counters
+	 */
+	FiberPoolStats GetFiberPoolStats(unsigned stackClass = 0);
+
 	/**
 	 * Set the behavior for how worker threads handle an empty queue
 	 *
@@ -280,41 +724,269 @@ public:
 	}
 
 private:
+	/**
+	 * Pushes a ready fiber onto the pinned ready fibers of a thread. Can be called from any thread
+	 *
+	 * @param tls       The ThreadLocalStorage of the thread the fiber is pinned to
+	 * @param bundle    The fiber bundle to push
+	 */
+	static void PushPinnedReadyFiber(ThreadLocalStorage *tls, WaitingFiberBundle *bundle);
+	/**
+	 * Gives a share of a task batch to a thread. Can be called from any thread
+	 *
+	 * @param tls         The ThreadLocalStorage of the thread to give the tasks to
+	 * @param priority    The priority of the tasks
+	 * @param count       The number of tasks
+	 * @param getValue    A callable that returns the i'th task to give, for i in [0, count)
+	 */
+	template <typename GetValue>
+	static void PushIncomingTasks(ThreadLocalStorage *tls, TaskPriority priority, size_t count, GetValue &&getValue);
+	/**
+	 * Moves the tasks that have been given to a thread onto the current thread's task queues
+	 *
+	 * @param from    The ThreadLocalStorage of the thread the tasks were given to. Can be the current thread
+	 * @param to      The ThreadLocalStorage of the current thread
+	 * @return        True if there were any tasks to take
+	 */
+	bool TakeIncomingTasks(ThreadLocalStorage *from, ThreadLocalStorage *to);
+	/**
+	 * Pushes values onto one of the current thread's queues. Whatever doesn't fit goes to the overflow queue
+	 *
+	 * @param queue       The queue. Must belong to the current thread
+	 * @param overflow    The overflow queue for the same kind of work
+	 * @param count       The number of values to push
+	 * @param getValue    A callable that returns the i'th value to push, for i in [0, count)
+	 */
+	template <typename T, size_t Capacity, typename GetValue>
+	static void PushOrSpill(WaitFreeQueue<T, Capacity> *queue, OverflowQueue<T> *overflow, size_t count, GetValue &&getValue);
+	/**
+	 * Pushes values onto an overflow queue, where any thread can take them
+	 *
+	 * @param overflow    The overflow queue
+	 * @param first       The index of the first value to push
+	 * @param count       The number of values to push, starting from first
+	 * @param getValue    A callable that returns the i'th value to push, for i in [first, first + count)
+	 */
+	template <typename T, typename GetValue>
+	static void Spill(OverflowQueue<T> *overflow, size_t first, size_t count, GetValue &&getValue);
+	/**
+	 * Takes the oldest value from an overflow queue, and moves a batch more onto one of the current thread's queues, if they fit
+	 *
+	 * @param overflow    The overflow queue
+	 * @param queue       The queue. Must belong to the current thread
+	 * @param value       If successful, filled with the oldest value
+	 * @return            True if there was anything to take
+	 */
+	template <typename T, size_t Capacity>
+	static bool TakeOverflow(OverflowQueue<T> *overflow, WaitFreeQueue<T, Capacity> *queue, T *value);
+	/**
+	 * Takes the tasks that have been given to another thread, but that it hasn't got to yet
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 * @return       True if any tasks were taken
+	 */
+	bool StealIncomingTasks(ThreadLocalStorage *tls);
+	/**
+	 * Pops the oldest ready fiber pinned to the current thread
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 * @return       The bundle of the ready fiber, or nullptr if there are none
+	 */
+	static WaitingFiberBundle *PopPinnedReadyFiber(ThreadLocalStorage *tls);
+	/**
+	 * Pops the next ready waiting fiber off the ready fiber queues. Our own queue is checked first,
+	 * then we try to steal from the other threads
+	 *
+	 * @param steal    If false, only our own queue is checked
+	 * @return         The bundle of the ready fiber, or nullptr if there are none
+	 */
+	WaitingFiberBundle *GetNextReadyFiber(bool steal);
+	/**
+	 * Picks the thread to try stealing from next, according to m_victimSelection
+	 *
+	 * @param tls                    The ThreadLocalStorage of the current thread
+	 * @param attempt                How many threads we've already tried this time. In [0, m_stealAttempts)
+	 * @param lastSuccessfulSteal    The thread we last stole from successfully, out of this kind of queue
+	 * @param queue                  The kind of queue we're stealing from. Used to see how much work each thread has
+	 * @return                       The index of the thread to steal from. Never the current thread
+	 */
+	template <typename Queue>
+	unsigned ChooseStealVictim(ThreadLocalStorage *tls, unsigned attempt, unsigned lastSuccessfulSteal, Queue ThreadLocalStorage::*queue) const;
 	/**
 	 * Pops the next task off the high priority queue into nextTask. If there are no tasks in the
 	 * the queue, it will return false.
 	 *
-	 * @param nextTask      If the queue is not empty, will be filled with the next task
-	 * @param taskBuffer    An empty buffer the function can use
-	 * @return              True: Successfully popped a task out of the queue
+	 * @param nextTask    If the queue is not empty, will be filled with the next task
+	 * @param steal       If false, only our own queue is checked
+	 * @return            True: Successfully popped a task out of the queue
 	 */
-	bool GetNextHiPriTask(TaskBundle *nextTask, std::vector<TaskBundle> *taskBuffer);
+	bool GetNextHiPriTask(TaskBundle *nextTask, bool steal);
 	/**
 	 * Pops the next task off the low priority queue into nextTask. If there are no tasks in the
 	 * the queue, it will return false.
 	 *
 	 * @param nextTask    If the queue is not empty, will be filled with the next task
+	 * @param steal       If false, only our own queue is checked
 	 * @return            True: Successfully popped a task out of the queue
 	 */
-	bool GetNextLoPriTask(TaskBundle *nextTask);
+	bool GetNextLoPriTask(TaskBundle *nextTask, bool steal);
 
 	/**
-	 * Checks if the Task is ready to execute
-	 * "Real" tasks are always ready. ReadyFiber dummy tasks may be still waiting for the fiber to be switched
-	 * away from.
+	 * Finds the index of the current thread by searching m_threads
+	 * This is the slow path of GetCurrentThreadIndex(), for threads that aren't bound to this TaskScheduler
 	 *
-	 * @param bundle    The task bundle to check
-	 * @return          True: task bundle is a "real" task or a ReadyFiber dummy task which is safe to execute
-	 *                  False: task bundle is a ReadyFiber dummy task which is not safe to execute
+	 * @return    The index of the current thread, or kInvalidIndex if the thread isn't one of ours
 	 */
-	bool TaskIsReadyToExecute(TaskBundle *bundle) const;
+	unsigned FindCurrentThreadIndex() const;
 
 	/**
 	 * Gets the index of the next available fiber in the pool
+	 * For class 0, the thread's FiberCache is checked first. If the class has run out and can't grow, a fiber
+	 * from a bigger class is used instead
+	 *
+	 * @param tls           The ThreadLocalStorage of the current thread
+	 * @param stackClass    The smallest stack class the fiber can be from
+	 * @return              The index of the next available fiber in the pool
+	 */
+	unsigned GetNextFreeFiberIndex(ThreadLocalStorage *tls, unsigned stackClass = 0);
+	/**
+	 * Returns a fiber to the pool of its stack class
+	 * Class 0 fibers go into the thread's FiberCache. If the cache is full, half of it is moved to the shared pool
 	 *
-	 * @return    The index of the next available fiber in the pool
+	 * @param tls           The ThreadLocalStorage of the current thread
+	 * @param fiberIndex    The index of the fiber to return
 	 */
-	unsigned GetNextFreeFiberIndex() const;
+	void ReturnFiberToPool(ThreadLocalStorage *tls, unsigned fiberIndex);
+	/**
+	 * Creates up to m_fiberPoolGrowthSize new fibers and adds them to the pool of a stack class
+	 *
+	 * @param stackClass    The stack class to grow
+	 * @return              True if the pool has free fibers now. False if it is already at the maximum size
+	 */
+	bool GrowFiberPool(FiberStackClass *stackClass);
+	/**
+	 * Gets the stack class that a fiber belongs to
+	 *
+	 * @param fiberIndex    The index of the fiber
+	 * @return              The index of the stack class in m_stackClasses
+	 */
+	unsigned GetFiberStackClass(unsigned fiberIndex) const;
+	/**
+	 * Gets the NUMA node a fiber's stack was placed on. Only the fibers that start in the threads' caches have one
+	 *
+	 * @param fiberIndex    The index of the fiber
+	 * @return              The node, or kInvalidIndex if the fiber doesn't have a home
+	 */
+	unsigned GetFiberHomeNode(unsigned fiberIndex) const;
+	/**
+	 * Creates the ThreadLocalStorage for the calling thread, and gives it its share of the fiber pool.
+	 * Must be called by the thread that owns the storage, after it's been pinned to its CPU
+	 *
+	 * @param threadIndex    The index of the calling thread
+	 */
+	void CreateThreadLocalStorage(unsigned threadIndex);
+	/**
+	 * Checks whether a thread is pinned to an efficiency core. See ThreadLocalStorage::Efficiency
+	 *
+	 * @param threadIndex    The index of the thread
+	 * @return               True if the thread is on a slower core than the fastest the threads have
+	 */
+	bool IsEfficiencyThread(unsigned threadIndex) const;
+	/**
+	 * Returns the lowest address of the stack for slot 'fiberIndex' in the StackArena of 'stackClass'
+	 */
+	static char *GetArenaFiberStack(FiberStackClass const *stackClass, unsigned fiberIndex) {
+		return stackClass->StackArena + (fiberIndex - stackClass->FirstFiberIndex) * stackClass->StackStride + (stackClass->StackStride - stackClass->StackSize);
+	}
+	/**
+	 * Creates the fiber in slot 'fiberIndex' of m_fibers, with a stack from the StackArena of its class if it has one
+	 *
+	 * @param stackClass    The stack class that owns the slot
+	 * @param fiberIndex    The index of the slot
+	 */
+	void CreatePoolFiber(FiberStackClass *stackClass, unsigned fiberIndex);
+	/**
+	 * Destroys the fiber in slot 'fiberIndex' of m_fibers, and gives its stack memory back to the OS
+	 *
+	 * @param stackClass    The stack class that owns the slot
+	 * @param fiberIndex    The index of the slot
+	 */
+	void DestroyPoolFiber(FiberStackClass *stackClass, unsigned fiberIndex);
+	/**
+	 * Gives the pages of a pooled fiber's stack deeper than m_fiberStackRetainSize back to the OS, if the fiber used them
+	 * This is best effort. A fiber is only caught if it waited while it was deep, since looking at the stack itself would cost
+	 * too much on every return. Missed pages stay committed until a later return to the pool catches them, or the fiber is trimmed
+	 *
+	 * @param stackClass    The stack class that owns the fiber
+	 * @param fiberIndex    The index of the fiber. It must not be running
+	 */
+	void ReclaimFiberStack(FiberStackClass const *stackClass, unsigned fiberIndex);
+	/**
+	 * Frees idle fibers from the shared pools of the stack classes that have grown, and haven't run out of
+	 * fibers for m_fiberPoolTrimDelayNs. Fibers in the threads' FiberCaches are not freed
+	 */
+	void TrimFiberPool();
+	/**
+	 * Puts the current thread to sleep until another thread wakes it, unless there is work to do
+	 * Used by EmptyQueueBehavior::Sleep and Adaptive
+	 */
+	void ParkCurrentThread();
+	/**
+	 * Checks if threads may be asleep when work is added, and so need to be woken
+	 *
+	 * @return    True if the EmptyQueueBehavior or MaxSpinningThreads let threads sleep
+	 */
+	bool ThreadsCanPark() const;
+	/**
+	 * Tries to let the current thread steal work from the other threads
+	 * Only m_maxSpinningThreads threads can do so at once
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 * @return       True if the thread may steal
+	 */
+	bool StartSpinning(ThreadLocalStorage *tls);
+	/**
+	 * Ends the current thread's turn stealing work, because it found some
+	 * If it was the last thread looking for work, this wakes another one to take its place
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 */
+	void StopSpinning(ThreadLocalStorage *tls);
+	/**
+	 * Waits a little before the next search for work, in EmptyQueueBehavior::Adaptive mode
+	 * Depending on how long the thread has been idle, this spins, yields, or puts the thread to sleep
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 */
+	void AdaptiveIdle(ThreadLocalStorage *tls);
+	/**
+	 * Updates the EmptyQueueBehavior::Adaptive spin budget once the thread has found work after being idle
+	 *
+	 * @param tls    The ThreadLocalStorage of the current thread
+	 */
+	static void EndAdaptiveIdle(ThreadLocalStorage *tls);
+	/**
+	 * Checks if there is anything the thread could run
+	 *
+	 * @param threadIndex    The index of the thread
+	 * @param steal          If true, this includes work the thread would have to steal
+	 * @return               True if any queue the thread looks in is non-empty
+	 */
+	bool HasPendingWork(unsigned threadIndex, bool steal) const;
+	/**
+	 * Wakes up to 'count' sleeping threads. Call this after adding work that any thread can run
+	 *
+	 * @param count           The maximum number of threads to wake
+	 * @param highPriority    True for high priority tasks and ready fibers. The reserved threads are woken first for them.
+	 *                        Otherwise, they aren't woken at all
+	 */
+	void WakeIdleThreads(unsigned count, bool highPriority);
+	/**
+	 * Wakes a specific thread, if it's sleeping. Call this after adding work only that thread can run
+	 *
+	 * @param threadIndex    The index of the thread to wake
+	 */
+	void WakeThread(unsigned threadIndex);
 	/**
 	 * If necessary, moves the old fiber to the fiber pool or the waiting list
 	 * The old fiber is the last fiber to run on the thread before the current fiber
@@ -332,19 +1004,31 @@ private:
 	/**
 	 * @brief Get's a free fiber from the pool and switches to it
 	 *
-	 * @param fiberIsSwitched    The boolean to set when the fiber is successfully switched away
+	 * @param bundle    The wait bundle of the current fiber. The fiber is marked as switched away once the switch is done
 	 */
-	void SwitchToFreeFiber(std::atomic<bool> *fiberIsSwitched);
+	void SwitchToFreeFiber(WaitingFiberBundle *bundle);
 
 	/**
 	 * Add a fiber to the "ready list". Fibers in the ready list will be resumed the next time a fiber goes searching
 	 * for a new task
 	 *
-	 * @param pinnedThreadIndex    The index of the thread this fiber is pinned to. If not pinned, this will equal kNoThreadPinning
-	 * @param bundle               The fiber bundle to add
-	 * up"
+	 * If the fiber hasn't finished switching away yet, the thread switching away from it will do the publishing instead
+	 *
+	 * @param bundle    The fiber bundle to add
 	 */
 	void AddReadyFiber(WaitingFiberBundle *bundle);
+	/**
+	 * Pushes a ready fiber that has been switched away from onto the ready queue of the current thread, or
+	 * the pinned ready fibers of the thread it's pinned to
+	 *
+	 * @param bundle    The fiber bundle to publish
+	 */
+	void PublishReadyFiber(WaitingFiberBundle *bundle);
+	/**
+	 * Switches every thread to its quit fiber, then joins the worker threads
+	 * Only valid once Init() has succeeded
+	 */
+	void QuitThreads();
 
 	/**
 	 * The threadProc function for all worker threads
@@ -359,6 +1043,31 @@ private:
 	 * @param arg    An instance of TaskScheduler
 	 */
 	static void FiberStartFunc(void *arg);
+	/**
+	 * The task function of a range task added by AddRangeTask()
+	 *
+	 * @param arg    The RangeTask
+	 */
+	template <TaskPriority Priority>
+	static void RangeTaskStartFunc(TaskScheduler *taskScheduler, void *arg);
+	/**
+	 * The task function of a half split off a range task
+	 *
+	 * @param arg    The RangeSplit
+	 */
+	static void RangeSplitStartFunc(TaskScheduler *taskScheduler, void *arg);
+	/**
+	 * Runs [begin, end) of a range task on the current fiber, splitting off halves for other threads while this thread's queue is empty
+	 * Doesn't return until the halves have been run, either by thieves, or here. The halves run here reuse this call's
+	 * frame, rather than recursing, so the stack use doesn't depend on the size of the range
+	 *
+	 * @param range       The range task
+	 * @param begin       The first index to run
+	 * @param end         One past the last index to run
+	 * @param grain       The most indices to pass to range->Function at once
+	 * @param priority    The priority of the queue the halves go in
+	 */
+	void RunRangeTask(RangeTask *range, size_t begin, size_t end, size_t grain, TaskPriority priority);
 	/**
 	 * The fiberProc function that fibers will jump to when Term() is called
 	 * This allows us to jump back to the worker thread original stacks and clean up
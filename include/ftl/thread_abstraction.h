@@ -125,6 +125,28 @@ bool JoinThread(ThreadType thread);
  */
 bool SetCurrentThreadAffinity(size_t coreAffinity);
 
+enum class ThreadSchedulingPolicy {
+	// The OS's default time sharing policy. The priority is a nice value: -20 (highest) to 19 (lowest)
+	Normal,
+	// Real-time. The thread runs until it blocks or yields, or a higher priority thread wants the CPU. The priority is 1 (lowest) to 99 (highest)
+	RealtimeFifo,
+	// Real-time. Like RealtimeFifo, but threads of the same priority take turns
+	RealtimeRoundRobin
+};
+
+/**
+ * Set the OS scheduling policy and priority for the current thread
+ *
+ * Real-time policies, and raising the priority above normal, usually need extra privileges. On Linux, that's CAP_SYS_NICE,
+ * or a high enough RLIMIT_RTPRIO / RLIMIT_NICE. On Windows, the policy is approximated with thread priority levels
+ * On other POSIX systems, such as macOS, nice values are per process. So ThreadSchedulingPolicy::Normal fails for any priority but 0
+ *
+ * @param policy      The scheduling policy
+ * @param priority    The priority, which depends on the policy. Real-time priorities are clamped to what the OS supports
+ * @return            True if the change was made. False if the thread is left as it was, for example if we don't have the privilege
+ */
+bool SetCurrentThreadPriority(ThreadSchedulingPolicy policy, int priority);
+
 /**
  * Sleep the current thread
  *
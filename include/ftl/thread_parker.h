@@ -0,0 +1,108 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+namespace ftl {
+
+/**
+ * Lets a thread sleep until another thread wakes it specifically
+ *
+ * This works like a binary semaphore. Unpark() leaves a single "token", and Park() consumes it, blocking
+ * until there is one. So an Unpark() that races ahead of the Park() it was meant for is never lost.
+ * The mutex and condition variable are only touched when the thread actually has to block
+ *
+ * NOTE: Only one thread may call Park() at a time
+ */
+class ThreadParker {
+public:
+	ThreadParker() = default;
+
+	ThreadParker(ThreadParker const &) = delete;
+	ThreadParker(ThreadParker &&) noexcept = delete;
+	ThreadParker &operator=(ThreadParker const &) = delete;
+	ThreadParker &operator=(ThreadParker &&) noexcept = delete;
+	~ThreadParker() = default;
+
+private:
+	constexpr static int kParked = -1;
+	constexpr static int kEmpty = 0;
+	constexpr static int kNotified = 1;
+
+	std::atomic<int> m_state{ kEmpty };
+	std::mutex m_lock;
+	std::condition_variable m_cv;
+
+public:
+	/**
+	 * Blocks the calling thread until Unpark() is called. Returns immediately if Unpark() was called since the last Park()
+	 */
+	void Park() {
+		// Fast path
+		// We already have a token
+		int expected = kNotified;
+		if (m_state.compare_exchange_strong(expected, kEmpty, std::memory_order_acquire, std::memory_order_relaxed)) {
+			return;
+		}
+
+		std::unique_lock<std::mutex> lock(m_lock);
+		expected = kEmpty;
+		if (!m_state.compare_exchange_strong(expected, kParked, std::memory_order_relaxed, std::memory_order_relaxed)) {
+			// We got a token between the fast path and taking the lock
+			m_state.exchange(kEmpty, std::memory_order_acquire);
+			return;
+		}
+
+		while (true) {
+			m_cv.wait(lock);
+
+			expected = kNotified;
+			if (m_state.compare_exchange_strong(expected, kEmpty, std::memory_order_acquire, std::memory_order_relaxed)) {
+				return;
+			}
+			// Spurious wakeup. Go back to sleep
+		}
+	}
+
+	/**
+	 * Wakes the parked thread, or makes its next Park() return immediately if it isn't parked
+	 */
+	void Unpark() {
+		if (m_state.exchange(kNotified, std::memory_order_release) != kParked) {
+			// Not sleeping. It'll see the token the next time it tries to park
+			return;
+		}
+
+		// Take the lock, so we can't notify between the parked thread setting kParked, and it starting to wait on the CV
+		{
+			std::lock_guard<std::mutex> lock(m_lock);
+		}
+		m_cv.notify_one();
+	}
+};
+
+} // End of namespace ftl
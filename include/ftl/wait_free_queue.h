@@ -30,26 +30,57 @@
 
 #pragma once
 
+#include "ftl/asymmetric_fence.h"
 #include "ftl/assert.h"
+#include "ftl/config.h"
+#include "ftl/ftl_valgrind.h"
 
 #include <atomic>
+#include <limits>
 #include <memory>
 #include <stddef.h>
 #include <stdint.h>
+#include <type_traits>
 #include <vector>
 
 namespace ftl {
 
-template <typename T>
+/**
+ * A work stealing deque. The owning thread pushes and pops at the bottom, and any other thread can steal from the top
+ *
+ * @tparam T           The item type. Must be cheap to copy
+ * @tparam Capacity    0 for a queue that grows on the heap whenever it fills up. Otherwise, the queue holds at most this many
+ *                     items, stored inline, and never allocates. Push() and PushBatch() report when it's full, so the caller can
+ *                     put the rest somewhere else. Must be a power of 2
+ *
+ * Pop() and the steals each need a seq_cst fence between their accesses of m_top and m_bottom. Normally both sides pay
+ * for a full fence. In asymmetric fence mode, Pop() only uses a compiler fence, and thieves pay for a heavy fence instead.
+ * See ftl/asymmetric_fence.h. If the heavy fence behaves like a full fence on the owner, at whatever point it lands,
+ * the usual Chase-Lev argument holds:
+ *   - If it lands between Pop()'s store of m_bottom and its load of m_top, it's the fence the argument expects
+ *   - If it lands before the store, the thief's load of m_top came before the owner's load. So the owner sees the same top
+ *     or a later one. If that leaves more than one item, the owner and a thief that wins its CAS take different ones.
+ *     If it leaves one, the owner uses a CAS too
+ *   - If it lands after the load, the thief's load of m_bottom comes after it, so the thief sees the owner's new bottom
+ * This pays off when local pops are far more common than steals
+ */
+template <typename T, size_t Capacity = 0>
 class WaitFreeQueue {
 private:
 	constexpr static size_t kStartingCircularArraySize = 32;
 
 public:
-	WaitFreeQueue()
+	static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be 0 or a power of 2");
+
+public:
+	/**
+	 * @param asymmetricFences    Use asymmetric fences, if the OS supports them. See AsymmetricFences()
+	 */
+	explicit WaitFreeQueue(bool const asymmetricFences = false)
 	        : m_top(1),    // m_top and m_bottom must start at 1
 	          m_bottom(1), // Otherwise, the first Pop on an empty queue will underflow m_bottom
-	          m_array(new CircularArray(kStartingCircularArraySize)) {
+	          m_asymmetricFences(asymmetricFences && EnableAsymmetricFences()) {
+		InitArray(&m_array);
 		FTL_VALGRIND_HG_DISABLE_CHECKING(&m_top, sizeof(m_top));
 		FTL_VALGRIND_HG_DISABLE_CHECKING(&m_bottom, sizeof(m_bottom));
 		FTL_VALGRIND_HG_DISABLE_CHECKING(&m_array, sizeof(m_array));
@@ -60,7 +91,7 @@ public:
 	WaitFreeQueue &operator=(WaitFreeQueue const &) = delete;
 	WaitFreeQueue &operator=(WaitFreeQueue &&) noexcept = delete;
 	~WaitFreeQueue() {
-		delete m_array.load(std::memory_order_relaxed);
+		FreeArray(&m_array);
 	}
 
 private:
@@ -73,9 +104,11 @@ private:
 
 	private:
 		std::vector<T> m_items;
-		std::unique_ptr<CircularArray> m_previous;
 
 	public:
+		/* The next array in GrowableStorage::Retired */
+		CircularArray *NextRetired = nullptr;
+
 		size_t Size() const {
 			return m_items.size();
 		}
@@ -88,12 +121,10 @@ private:
 			m_items[index & (Size() - 1)] = x;
 		}
 
-		// Growing the array returns a new circular_array object and keeps a
-		// linked list of all previous arrays. This is done because other threads
-		// could still be accessing elements from the smaller arrays.
-		CircularArray *Grow(size_t const top, size_t const bottom) {
-			auto *const newArray = new CircularArray(Size() * 2);
-			newArray->m_previous.reset(this);
+		// Copies the items in [top, bottom) into a new array of newSize
+		// The old array isn't freed here, because other threads could still be reading from it. See GrowableStorage
+		CircularArray *Resize(size_t const top, size_t const bottom, size_t const newSize) {
+			auto *const newArray = new CircularArray(newSize);
 			for (size_t i = top; i != bottom; i++) {
 				newArray->Put(i, Get(i));
 			}
@@ -101,75 +132,328 @@ private:
 		}
 	};
 
+	// The storage of a growable queue
+	struct GrowableStorage {
+		std::atomic<CircularArray *> Current;
+		/**
+		 * Arrays that have been replaced, but stealers may still be reading from. Only the owner touches this
+		 * They're freed once Readers drops to zero. Each array is at most half the size of the next, so these
+		 * never add up to more than Current
+		 */
+		CircularArray *Retired;
+		/* The number of stealers between AcquireArray() and ReleaseArray(). On its own cache line, so stealers don't slow down the owner */
+		alignas(kCacheLineSize) std::atomic<unsigned> Readers;
+	};
+
+	// The inline storage of a fixed capacity queue
+	class FixedArray {
+	private:
+		T m_items[Capacity == 0 ? 1 : Capacity];
+
+	public:
+		constexpr static size_t Size() {
+			return Capacity;
+		}
+
+		T Get(size_t const index) {
+			return m_items[index & (Capacity - 1)];
+		}
+
+		void Put(size_t const index, T x) {
+			m_items[index & (Capacity - 1)] = x;
+		}
+	};
+
+	using Array = typename std::conditional<Capacity == 0, CircularArray, FixedArray>::type;
+	using ArrayStorage = typename std::conditional<Capacity == 0, GrowableStorage, FixedArray>::type;
+
+	static void InitArray(GrowableStorage *storage) {
+		storage->Current.store(new CircularArray(kStartingCircularArraySize), std::memory_order_relaxed);
+		storage->Retired = nullptr;
+		storage->Readers.store(0, std::memory_order_relaxed);
+	}
+	static void InitArray(FixedArray * /*storage*/) {
+	}
+	static void FreeArray(GrowableStorage *storage) {
+		delete storage->Current.load(std::memory_order_relaxed);
+		FreeRetired(storage);
+	}
+	static void FreeArray(FixedArray * /*storage*/) {
+	}
+	// The owner's view of the array
+	static CircularArray *LoadArray(GrowableStorage *storage) {
+		return storage->Current.load(std::memory_order_relaxed);
+	}
+	static FixedArray *LoadArray(FixedArray *storage) {
+		return storage;
+	}
+
+	/**
+	 * A stealer's view of the array. It stays valid until the matching ReleaseArray()
+	 * The increment is seq_cst, and so is the load. So if the owner's check in Reclaim() missed our increment,
+	 * we're guaranteed to load the array that replaced the ones it frees
+	 */
+	static CircularArray *AcquireArray(GrowableStorage *storage) {
+		storage->Readers.fetch_add(1, std::memory_order_seq_cst);
+		return storage->Current.load(std::memory_order_seq_cst);
+	}
+	static FixedArray *AcquireArray(FixedArray *storage) {
+		return storage;
+	}
+	static void ReleaseArray(GrowableStorage *storage) {
+		// Release, so our reads of the array happen before the owner frees it
+		storage->Readers.fetch_sub(1, std::memory_order_release);
+	}
+	static void ReleaseArray(FixedArray * /*storage*/) {
+	}
+
+	// Replaces the array with one of newSize, and retires the old one. Only the owner may call this
+	static CircularArray *ResizeArray(GrowableStorage *storage, CircularArray *array, uint64_t const top, uint64_t const bottom, size_t const newSize) {
+		CircularArray *const newArray = array->Resize(top, bottom, newSize);
+		storage->Current.store(newArray, std::memory_order_release);
+
+		array->NextRetired = storage->Retired;
+		storage->Retired = array;
+		Reclaim(storage);
+		return newArray;
+	}
+	// Makes room for at least minSize items. Only the owner may call this
+	static bool GrowArray(GrowableStorage *storage, CircularArray **array, uint64_t const top, uint64_t const bottom, size_t const minSize) {
+		size_t newSize = (*array)->Size() * 2;
+		while (newSize < minSize) {
+			newSize *= 2;
+		}
+		*array = ResizeArray(storage, *array, top, bottom, newSize);
+		return true;
+	}
+	static bool GrowArray(FixedArray * /*storage*/, FixedArray ** /*array*/, uint64_t /*top*/, uint64_t /*bottom*/, size_t /*minSize*/) {
+		return false;
+	}
+	/**
+	 * Moves the items to a smaller array, once the queue has drained to an eighth of the array. The new array is a quarter full at most,
+	 * so a queue hovering around one size doesn't flip back and forth. Only the owner may call this
+	 */
+	static void ShrinkArray(GrowableStorage *storage, CircularArray *array, uint64_t const top, uint64_t const bottom) {
+		size_t const count = bottom - top;
+		size_t const size = array->Size();
+		if (size <= kStartingCircularArraySize || count > size / 8) {
+			return;
+		}
+
+		size_t newSize = size;
+		while (newSize / 2 >= kStartingCircularArraySize && newSize / 2 >= count * 4) {
+			newSize /= 2;
+		}
+		ResizeArray(storage, array, top, bottom, newSize);
+	}
+	static void ShrinkArray(FixedArray * /*storage*/, FixedArray * /*array*/, uint64_t /*top*/, uint64_t /*bottom*/) {
+	}
+
+	// Frees the retired arrays, if no stealer could be reading from them. Only the owner may call this
+	static void Reclaim(GrowableStorage *storage) {
+		if (storage->Retired == nullptr) {
+			return;
+		}
+
+		// Pairs with the seq_cst operations in AcquireArray(). Current has already been replaced, so any stealer
+		// we don't count here will load the new array
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (storage->Readers.load(std::memory_order_acquire) != 0) {
+			/* Someone may still be reading. Try again later. */
+			return;
+		}
+		FreeRetired(storage);
+	}
+	static void Reclaim(FixedArray * /*storage*/) {
+	}
+	static void FreeRetired(GrowableStorage *storage) {
+		CircularArray *retired = storage->Retired;
+		while (retired != nullptr) {
+			CircularArray *const next = retired->NextRetired;
+			delete retired;
+			retired = next;
+		}
+		storage->Retired = nullptr;
+	}
+
 #pragma warning(push)
 #pragma warning(disable : 4324) // MSVC warning C4324: structure was padded due to alignment specifier
 	alignas(kCacheLineSize) std::atomic<uint64_t> m_top;
 	alignas(kCacheLineSize) std::atomic<uint64_t> m_bottom;
-	alignas(kCacheLineSize) std::atomic<CircularArray *> m_array;
+	// Next to m_bottom, since the owner and the thieves both read that anyway
+	bool const m_asymmetricFences;
+	alignas(kCacheLineSize) ArrayStorage m_array;
 #pragma warning(pop)
 
 public:
-	void Push(T value) {
+	/**
+	 * Pushes a value onto the bottom of the queue. Only the owner may call this
+	 *
+	 * @param value    The value to push
+	 * @return         True on success. Always true if Capacity is 0. Otherwise, false if the queue is full, in which case nothing is pushed
+	 */
+	bool Push(T value) {
 		uint64_t b = m_bottom.load(std::memory_order_relaxed);
 		uint64_t t = m_top.load(std::memory_order_acquire);
-		CircularArray *array = m_array.load(std::memory_order_relaxed);
+		Array *array = LoadArray(&m_array);
 
 		if (b - t > array->Size() - 1) {
 			/* Full queue. */
-			array = array->Grow(t, b);
-			m_array.store(array, std::memory_order_release);
+			if (!GrowArray(&m_array, &array, t, b, 0)) {
+				return false;
+			}
 		}
 		array->Put(b, value);
 
 		std::atomic_thread_fence(std::memory_order_release);
 
 		m_bottom.store(b + 1, std::memory_order_relaxed);
+		return true;
+	}
+
+	/**
+	 * Pushes count values at once. The array grows at most once, and the values are all published with a
+	 * single update of m_bottom. So stealers see either none or all of them
+	 *
+	 * @param count        The number of values to push
+	 * @param getValue     A callable that returns the i'th value to push, for i in [0, count)
+	 * @return             The number of values pushed. Always count if Capacity is 0. Otherwise, only as many as fit,
+	 *                     starting from the first. The caller is responsible for the rest
+	 */
+	template <typename GetValue>
+	size_t PushBatch(size_t count, GetValue &&getValue) {
+		if (count == 0) {
+			return 0;
+		}
+
+		uint64_t b = m_bottom.load(std::memory_order_relaxed);
+		uint64_t t = m_top.load(std::memory_order_acquire);
+		Array *array = LoadArray(&m_array);
+
+		if (b - t + count > array->Size()) {
+			/* Not enough room for all of them. */
+			if (!GrowArray(&m_array, &array, t, b, b - t + count)) {
+				count = array->Size() - (b - t);
+				if (count == 0) {
+					return 0;
+				}
+			}
+		}
+		for (size_t i = 0; i < count; ++i) {
+			array->Put(b + i, getValue(i));
+		}
+
+		std::atomic_thread_fence(std::memory_order_release);
+
+		m_bottom.store(b + count, std::memory_order_relaxed);
+		return count;
 	}
 
 	bool Pop(T *value) {
 		uint64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
-		CircularArray *const array = m_array.load(std::memory_order_relaxed);
+		Array *const array = LoadArray(&m_array);
 		m_bottom.store(b, std::memory_order_relaxed);
 
-		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (m_asymmetricFences) {
+			AsymmetricFenceLight();
+		} else {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+		}
 
 		uint64_t t = m_top.load(std::memory_order_relaxed);
-		bool result = true;
 		if (t <= b) {
 			/* Non-empty queue. */
 			*value = array->Get(b);
 			if (t == b) {
 				/* Single last element in queue. */
-				if (!std::atomic_compare_exchange_strong_explicit(&m_top, &t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
-					/* Failed race. */
-					result = false;
-				}
+				bool const won = std::atomic_compare_exchange_strong_explicit(&m_top, &t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
 				m_bottom.store(b + 1, std::memory_order_relaxed);
+				return won;
 			}
-		} else {
-			/* Empty queue. */
-			result = false;
-			m_bottom.store(b + 1, std::memory_order_relaxed);
+
+			ShrinkArray(&m_array, array, t, b);
+			return true;
 		}
 
-		return result;
+		/* Empty queue. */
+		m_bottom.store(b + 1, std::memory_order_relaxed);
+		// A good time to tidy up. Stealers won't find anything here, so they're unlikely to be holding on to old arrays
+		ShrinkArray(&m_array, array, b + 1, b + 1);
+		Reclaim(&m_array);
+		return false;
+	}
+
+	/**
+	 * @return    True if the queue looked empty. This is only a snapshot. Other threads can push or steal at any time
+	 */
+	bool Empty() const {
+		uint64_t const b = m_bottom.load(std::memory_order_relaxed);
+		uint64_t const t = m_top.load(std::memory_order_relaxed);
+		return b <= t;
+	}
+
+	/**
+	 * @return    The number of items the queue can hold before it has to grow. Only the owner may call this
+	 */
+	size_t ArraySize() {
+		return LoadArray(&m_array)->Size();
+	}
+
+	/**
+	 * @return    Roughly how many items are in the queue. This is only a snapshot, and can be off while other threads push, pop, or steal
+	 */
+	size_t SizeEstimate() const {
+		uint64_t const b = m_bottom.load(std::memory_order_relaxed);
+		uint64_t const t = m_top.load(std::memory_order_relaxed);
+		return b > t ? b - t : 0;
+	}
+
+	/**
+	 * @return    True if Pop() only uses a compiler fence, and thieves use heavy fences
+	 */
+	bool AsymmetricFences() const {
+		return m_asymmetricFences;
 	}
 
 	bool Steal(T *const value) {
 		uint64_t t = m_top.load(std::memory_order_acquire);
 
-		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (!ThiefFence(t)) {
+			return false;
+		}
 
 		uint64_t const b = m_bottom.load(std::memory_order_acquire);
 		if (t < b) {
 			/* Non-empty queue. */
-			CircularArray *const array = m_array.load(std::memory_order_consume);
+			Array *const array = AcquireArray(&m_array);
 			*value = array->Get(t);
+			ReleaseArray(&m_array);
 			return std::atomic_compare_exchange_strong_explicit(&m_top, &t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
 		}
 
 		return false;
 	}
+
+private:
+	/**
+	 * The fence between a thief's loads of m_top and m_bottom
+	 * A heavy fence is a system call, so don't pay for it when the queue already looks empty. Like any failed steal, the
+	 * thief will just look again later
+	 *
+	 * @return    False if the queue looked empty, in which case there was no fence
+	 */
+	bool ThiefFence(uint64_t const top) const {
+		if (!m_asymmetricFences) {
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			return true;
+		}
+
+		if (m_bottom.load(std::memory_order_relaxed) <= top) {
+			return false;
+		}
+		AsymmetricFenceHeavy();
+		return true;
+	}
 };
 
 } // End of namespace ftl
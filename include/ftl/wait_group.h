@@ -59,6 +59,8 @@ private:
 
 	/* The counter that can be waited on. Once it is zero, all waiters will be released */
 	std::atomic<int32_t> m_counter;
+	/* The counter reached zero, and Add() is still taking the waiters off the queue. Add() and Wait() spin until it is done */
+	static constexpr int32_t kReleasing = -1;
 	/* We store the queue lock and the queue all in a single uintptr_t */
 	std::atomic<uintptr_t> m_word;
 
@@ -30,6 +30,12 @@
 #if defined(FTL_OS_LINUX) || defined(FTL_OS_MAC) || defined(FTL_iOS)
 #	include <sys/mman.h>
 #	include <unistd.h>
+#	if defined(FTL_OS_LINUX)
+#		include <sys/syscall.h>
+
+#		include <climits>
+#		include <vector>
+#	endif
 #elif defined(FTL_OS_WINDOWS)
 #	define WIN32_LEAN_AND_MEAN
 #	define NOMINMAX
@@ -78,6 +84,59 @@ void AlignedFree(void *block) {
 	free(block);
 }
 
+void *MemoryReserve(size_t bytes) {
+	void *memory = mmap(nullptr, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (memory == MAP_FAILED) {
+		return nullptr;
+	}
+
+	return memory;
+}
+
+void MemoryReserveRelease(void *memory, size_t bytes) {
+	int const result = munmap(memory, bytes);
+	FTL_ASSERT("munmap", !result);
+#	if defined(NDEBUG)
+	// Void out the result for release, so the compiler doesn't get cranky about an unused variable
+	(void)result;
+#	endif
+}
+
+bool MemoryCommit(void *memory, size_t bytes) {
+	return mprotect(memory, bytes, PROT_READ | PROT_WRITE) == 0;
+}
+
+void MemoryDecommit(void *memory, size_t bytes) {
+	// MADV_DONTNEED, rather than MADV_FREE, so the pages are guaranteed to read as zero afterwards
+	int const result = madvise(memory, bytes, MADV_DONTNEED);
+	FTL_ASSERT("madvise", !result);
+#	if defined(NDEBUG)
+	// Void out the result for release, so the compiler doesn't get cranky about an unused variable
+	(void)result;
+#	endif
+}
+
+bool MemoryBindToNode(void *memory, size_t bytes, unsigned node) {
+#	if defined(FTL_OS_LINUX) && defined(SYS_mbind)
+	// Call mbind() directly, so we don't need to link libnuma
+	// MPOL_PREFERRED, rather than MPOL_BIND, so we still get memory if the node runs out
+	constexpr int kMpolPreferred = 1;
+	constexpr size_t kBitsPerWord = sizeof(unsigned long) * CHAR_BIT;
+
+	std::vector<unsigned long> nodeMask(node / kBitsPerWord + 1, 0);
+	nodeMask[node / kBitsPerWord] = 1UL << (node % kBitsPerWord);
+	// The kernel ignores the last bit of maxnode
+	unsigned long const maxNode = nodeMask.size() * kBitsPerWord + 1;
+
+	return syscall(SYS_mbind, memory, bytes, kMpolPreferred, nodeMask.data(), maxNode, 0) == 0;
+#	else
+	(void)memory;
+	(void)bytes;
+	(void)node;
+	return false;
+#	endif
+}
+
 #elif defined(FTL_OS_WINDOWS)
 
 void MemoryGuard(void *memory, size_t bytes) {
@@ -109,6 +168,42 @@ void *AlignedAlloc(size_t size, size_t alignment) {
 void AlignedFree(void *block) {
 	_aligned_free(block);
 }
+
+void *MemoryReserve(size_t bytes) {
+	return VirtualAlloc(nullptr, bytes, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+void MemoryReserveRelease(void *memory, size_t bytes) {
+	(void)bytes;
+
+	BOOL const result = VirtualFree(memory, 0, MEM_RELEASE);
+	FTL_ASSERT("VirtualFree", result);
+	(void)result;
+}
+
+bool MemoryCommit(void *memory, size_t bytes) {
+	return VirtualAlloc(memory, bytes, MEM_COMMIT, PAGE_READWRITE) != nullptr;
+}
+
+void MemoryDecommit(void *memory, size_t bytes) {
+	// MEM_RESET doesn't guarantee the pages are zeroed. So decommit and re-commit instead
+	BOOL const result = VirtualFree(memory, bytes, MEM_DECOMMIT);
+	FTL_ASSERT("VirtualFree", result);
+	(void)result;
+
+	bool const committed = MemoryCommit(memory, bytes);
+	FTL_ASSERT("VirtualAlloc", committed);
+	(void)committed;
+}
+
+bool MemoryBindToNode(void *memory, size_t bytes, unsigned node) {
+	// Windows can only pick the node when the pages are first committed, with VirtualAllocExNuma(). It already prefers the
+	// node of the thread that first touches a page though
+	(void)memory;
+	(void)bytes;
+	(void)node;
+	return false;
+}
 #else
 #	error "Unknown platform"
 #endif
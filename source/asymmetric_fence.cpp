@@ -0,0 +1,94 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/asymmetric_fence.h"
+
+#include "ftl/assert.h"
+#include "ftl/config.h"
+
+#if defined(FTL_OS_LINUX)
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#elif defined(FTL_OS_WINDOWS)
+#	ifndef WIN32_LEAN_AND_MEAN
+#		define WIN32_LEAN_AND_MEAN
+#	endif
+#	ifndef NOMINMAX
+#		define NOMINMAX
+#	endif
+#	include <windows.h>
+#endif
+
+namespace ftl {
+
+#if defined(FTL_OS_LINUX) && defined(SYS_membarrier)
+
+// From linux/membarrier.h, which older headers don't have
+constexpr static int kMembarrierCmdQuery = 0;
+constexpr static int kMembarrierCmdPrivateExpedited = 1 << 3;
+constexpr static int kMembarrierCmdRegisterPrivateExpedited = 1 << 4;
+
+static bool RegisterAsymmetricFences() {
+	long const supported = syscall(SYS_membarrier, kMembarrierCmdQuery, 0);
+	if (supported < 0 || (supported & kMembarrierCmdPrivateExpedited) == 0) {
+		return false;
+	}
+	// The process has to register before it can use the expedited command
+	return syscall(SYS_membarrier, kMembarrierCmdRegisterPrivateExpedited, 0) == 0;
+}
+
+void AsymmetricFenceHeavy() {
+	long const result = syscall(SYS_membarrier, kMembarrierCmdPrivateExpedited, 0);
+	FTL_ASSERT("membarrier", result == 0);
+	(void)result;
+}
+
+#elif defined(FTL_OS_WINDOWS)
+
+static bool RegisterAsymmetricFences() {
+	return true;
+}
+
+void AsymmetricFenceHeavy() {
+	FlushProcessWriteBuffers();
+}
+
+#else
+
+static bool RegisterAsymmetricFences() {
+	return false;
+}
+
+void AsymmetricFenceHeavy() {
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+#endif
+
+bool EnableAsymmetricFences() {
+	static bool const enabled = RegisterAsymmetricFences();
+	return enabled;
+}
+
+} // End of namespace ftl
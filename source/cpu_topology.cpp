@@ -0,0 +1,377 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/cpu_topology.h"
+
+#include "ftl/config.h"
+#include "ftl/thread_abstraction.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(FTL_OS_LINUX)
+#	include <dirent.h>
+#	include <sched.h>
+#	include <string.h>
+
+#	include <string>
+#endif
+
+namespace ftl {
+
+#if defined(FTL_OS_LINUX)
+
+constexpr static unsigned kUnknown = ~0U;
+
+// Parses a kernel CPU list, like "0-3,8,10-11"
+static std::vector<unsigned> ParseCpuList(char const *list) {
+	std::vector<unsigned> cpus;
+
+	char const *c = list;
+	while (*c != '\0' && *c != '\n') {
+		char *end;
+		unsigned long const first = strtoul(c, &end, 10);
+		if (end == c) {
+			break;
+		}
+		unsigned long last = first;
+		if (*end == '-') {
+			c = end + 1;
+			last = strtoul(c, &end, 10);
+		}
+		for (unsigned long cpu = first; cpu <= last; ++cpu) {
+			cpus.push_back(static_cast<unsigned>(cpu));
+		}
+
+		c = end;
+		if (*c == ',') {
+			++c;
+		}
+	}
+
+	return cpus;
+}
+
+// Reads the first line of a sysfs file. Returns false if it doesn't exist
+static bool ReadSysFile(char const *path, char *buffer, size_t bufferSize) {
+	FILE *file = fopen(path, "r");
+	if (file == nullptr) {
+		return false;
+	}
+
+	bool const success = fgets(buffer, static_cast<int>(bufferSize), file) != nullptr;
+	fclose(file);
+	return success;
+}
+
+static unsigned ReadSysUnsigned(char const *path) {
+	char buffer[64];
+	if (!ReadSysFile(path, buffer, sizeof(buffer))) {
+		return kUnknown;
+	}
+	return static_cast<unsigned>(strtoul(buffer, nullptr, 10));
+}
+
+// The lowest CPU in a sysfs CPU list file. Good as an id for the group of CPUs it lists
+static unsigned ReadSysCpuListId(char const *path) {
+	char buffer[4096];
+	if (!ReadSysFile(path, buffer, sizeof(buffer))) {
+		return kUnknown;
+	}
+
+	std::vector<unsigned> const cpus = ParseCpuList(buffer);
+	if (cpus.empty()) {
+		return kUnknown;
+	}
+	return *std::min_element(cpus.begin(), cpus.end());
+}
+
+static unsigned ReadLastLevelCacheId(unsigned cpu) {
+	// Walk the caches, and take the highest level one
+	unsigned bestLevel = 0;
+	unsigned id = kUnknown;
+
+	char path[256];
+	for (unsigned index = 0;; ++index) {
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/level", cpu, index);
+		unsigned const level = ReadSysUnsigned(path);
+		if (level == kUnknown) {
+			break;
+		}
+		if (level > bestLevel) {
+			snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cache/index%u/shared_cpu_list", cpu, index);
+			bestLevel = level;
+			id = ReadSysCpuListId(path);
+		}
+	}
+
+	return id;
+}
+
+static unsigned ReadNodeId(unsigned cpu) {
+	char path[256];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u", cpu);
+
+	DIR *dir = opendir(path);
+	if (dir == nullptr) {
+		return kUnknown;
+	}
+
+	// The CPU's directory has a "nodeN" link to the NUMA node it's in
+	unsigned id = kUnknown;
+	while (dirent *entry = readdir(dir)) {
+		unsigned node;
+		if (sscanf(entry->d_name, "node%u", &node) == 1) {
+			id = node;
+			break;
+		}
+	}
+
+	closedir(dir);
+	return id;
+}
+
+// Intel hybrid CPUs have separate PMUs for their performance ("core") and efficiency ("atom") cores. The kernel
+// doesn't always report cpu_capacity for them, so we fall back to this. It's only a rough guess at the relative speed
+constexpr static unsigned kAtomCoreCapacity = kMaxCpuCapacity / 2;
+
+static void ReadLinuxCpuTopology(std::vector<CpuInfo> *cpus) {
+	char buffer[4096];
+	std::vector<unsigned> atomCpus;
+	if (ReadSysFile("/sys/devices/cpu_atom/cpus", buffer, sizeof(buffer))) {
+		atomCpus = ParseCpuList(buffer);
+	}
+
+	if (!ReadSysFile("/sys/devices/system/cpu/online", buffer, sizeof(buffer))) {
+		return;
+	}
+
+	char path[256];
+	for (unsigned const cpu : ParseCpuList(buffer)) {
+		CpuInfo info{};
+		info.Id = cpu;
+
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/thread_siblings_list", cpu);
+		info.CoreId = ReadSysCpuListId(path);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/topology/physical_package_id", cpu);
+		info.PackageId = ReadSysUnsigned(path);
+		info.CacheId = ReadLastLevelCacheId(cpu);
+		info.NodeId = ReadNodeId(cpu);
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%u/cpu_capacity", cpu);
+		info.Capacity = ReadSysUnsigned(path);
+
+		// Fill in anything the kernel doesn't tell us as conservatively as we can
+		if (info.CoreId == kUnknown) {
+			info.CoreId = cpu;
+		}
+		if (info.PackageId == kUnknown) {
+			info.PackageId = 0;
+		}
+		if (info.CacheId == kUnknown) {
+			info.CacheId = info.PackageId;
+		}
+		if (info.NodeId == kUnknown) {
+			info.NodeId = 0;
+		}
+		if (info.Capacity == kUnknown || info.Capacity == 0) {
+			bool const atom = std::find(atomCpus.begin(), atomCpus.end(), cpu) != atomCpus.end();
+			info.Capacity = atom ? kAtomCoreCapacity : kMaxCpuCapacity;
+		}
+
+		cpus->push_back(info);
+	}
+}
+
+static unsigned ReadCgroupCpuQuota() {
+	// The cgroup v2 hierarchy is the line that starts with "0::"
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	if (file == nullptr) {
+		return 0;
+	}
+
+	std::string path;
+	bool found = false;
+	char line[4096];
+	while (fgets(line, sizeof(line), file) != nullptr) {
+		if (strncmp(line, "0::", 3) == 0) {
+			path = line + 3;
+			found = true;
+			break;
+		}
+	}
+	fclose(file);
+
+	if (!found) {
+		return 0;
+	}
+	while (!path.empty() && (path.back() == '\n' || path.back() == '/')) {
+		path.pop_back();
+	}
+
+	// Our parents' limits apply too. So walk up to the root, and take the tightest
+	unsigned quota = 0;
+	while (true) {
+		std::string const cpuMaxPath = "/sys/fs/cgroup" + path + "/cpu.max";
+		char buffer[128];
+		unsigned long long limit;
+		unsigned long long period;
+		// "max 100000" means there's no limit, and won't parse
+		if (ReadSysFile(cpuMaxPath.c_str(), buffer, sizeof(buffer)) && sscanf(buffer, "%llu %llu", &limit, &period) == 2 && period != 0) {
+			unsigned const cpus = static_cast<unsigned>(std::max((limit + period - 1) / period, 1ULL));
+			quota = quota == 0 ? cpus : std::min(quota, cpus);
+		}
+
+		if (path.empty()) {
+			break;
+		}
+		path.erase(path.rfind('/'));
+	}
+
+	return quota;
+}
+
+#endif
+
+std::vector<CpuInfo> GetCpuTopology() {
+	std::vector<CpuInfo> cpus;
+#if defined(FTL_OS_LINUX)
+	ReadLinuxCpuTopology(&cpus);
+#endif
+
+	if (cpus.empty()) {
+		unsigned const numCpus = std::max(GetNumHardwareThreads(), 1U);
+		for (unsigned i = 0; i < numCpus; ++i) {
+			cpus.push_back({ i, i, 0, 0, 0, kMaxCpuCapacity });
+		}
+	}
+
+	return cpus;
+}
+
+std::vector<CpuInfo> OrderCpusForPlacement(std::vector<CpuInfo> cpus) {
+	// Number each CPU by which hardware thread it is on its core. 0 for the first, 1 for its SMT sibling, ...
+	std::vector<unsigned> smtIndex(cpus.size(), 0);
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		for (size_t j = 0; j < i; ++j) {
+			if (cpus[j].CoreId == cpus[i].CoreId) {
+				++smtIndex[i];
+			}
+		}
+	}
+
+	std::vector<size_t> order(cpus.size());
+	for (size_t i = 0; i < order.size(); ++i) {
+		order[i] = i;
+	}
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		if (smtIndex[a] != smtIndex[b]) {
+			return smtIndex[a] < smtIndex[b];
+		}
+		if (cpus[a].Capacity != cpus[b].Capacity) {
+			return cpus[a].Capacity > cpus[b].Capacity;
+		}
+		if (cpus[a].NodeId != cpus[b].NodeId) {
+			return cpus[a].NodeId < cpus[b].NodeId;
+		}
+		if (cpus[a].PackageId != cpus[b].PackageId) {
+			return cpus[a].PackageId < cpus[b].PackageId;
+		}
+		return cpus[a].CacheId < cpus[b].CacheId;
+	});
+
+	std::vector<CpuInfo> ordered;
+	ordered.reserve(cpus.size());
+	for (size_t const i : order) {
+		ordered.push_back(cpus[i]);
+	}
+	return ordered;
+}
+
+unsigned CpuDistance(CpuInfo const &a, CpuInfo const &b) {
+	if (a.CoreId == b.CoreId) {
+		return 0;
+	}
+	if (a.CacheId == b.CacheId) {
+		return 1;
+	}
+	if (a.PackageId == b.PackageId) {
+		return 2;
+	}
+	if (a.NodeId == b.NodeId) {
+		return 3;
+	}
+	return 4;
+}
+
+std::vector<unsigned> GetCurrentThreadAllowedCpus() {
+	std::vector<unsigned> cpus;
+#if defined(FTL_OS_LINUX)
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0) {
+		for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			if (CPU_ISSET(cpu, &cpuSet)) {
+				cpus.push_back(cpu);
+			}
+		}
+	}
+#endif
+
+	if (cpus.empty()) {
+		for (CpuInfo const &cpu : GetCpuTopology()) {
+			cpus.push_back(cpu.Id);
+		}
+		std::sort(cpus.begin(), cpus.end());
+	}
+
+	return cpus;
+}
+
+bool SetCurrentThreadAllowedCpus(std::vector<unsigned> const &cpus) {
+#if defined(FTL_OS_LINUX)
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	for (unsigned const cpu : cpus) {
+		if (cpu < CPU_SETSIZE) {
+			CPU_SET(cpu, &cpuSet);
+		}
+	}
+
+	return sched_setaffinity(0, sizeof(cpu_set_t), &cpuSet) == 0;
+#else
+	(void)cpus;
+	return false;
+#endif
+}
+
+unsigned GetCpuQuota() {
+#if defined(FTL_OS_LINUX)
+	return ReadCgroupCpuQuota();
+#else
+	return 0;
+#endif
+}
+
+} // End of namespace ftl
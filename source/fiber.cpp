@@ -35,7 +35,7 @@ namespace ftl {
 size_t RoundUp(size_t numToRound, size_t multiple);
 
 Fiber::Fiber(size_t stackSize, FiberStartRoutine startRoutine, void *arg)
-        : m_arg(arg) {
+        : m_ownsStack(true), m_arg(arg) {
 #if defined(FTL_FIBER_STACK_GUARD_PAGES)
 	m_systemPageSize = SystemPageSize();
 	const size_t alignment = SystemPageSize();
@@ -57,6 +57,13 @@ Fiber::Fiber(size_t stackSize, FiberStartRoutine startRoutine, void *arg)
 #endif
 }
 
+Fiber::Fiber(void *stack, size_t stackSize, FiberStartRoutine startRoutine, void *arg)
+        : m_stack(stack), m_ownsStack(false), m_systemPageSize(0), m_stackSize(stackSize), m_arg(arg) {
+	m_context = boost_context::make_fcontext(static_cast<char *>(m_stack) + stackSize, stackSize, startRoutine);
+
+	FTL_VALGRIND_REGISTER(static_cast<char *>(m_stack), static_cast<char *>(m_stack) + stackSize);
+}
+
 Fiber::~Fiber() {
 	if (m_stack != nullptr) {
 		if (m_systemPageSize != 0) {
@@ -65,12 +72,15 @@ Fiber::~Fiber() {
 		}
 		FTL_VALGRIND_DEREGISTER();
 
-		AlignedFree(m_stack);
+		if (m_ownsStack) {
+			AlignedFree(m_stack);
+		}
 	}
 }
 
 void Fiber::Swap(Fiber &first, Fiber &second) noexcept {
 	std::swap(first.m_stack, second.m_stack);
+	std::swap(first.m_ownsStack, second.m_ownsStack);
 	std::swap(first.m_systemPageSize, second.m_systemPageSize);
 	std::swap(first.m_stackSize, second.m_stackSize);
 	std::swap(first.m_context, second.m_context);
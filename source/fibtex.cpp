@@ -147,11 +147,11 @@ void Fibtex::LockSlow(bool pinToCurrentThread) {
 		}
 
 		// At this point everyone who acquires the queue lock will see `currentFiber` on the queue.
-		// `currentFiber.FiberIsSwitched` will still be false though, so any any other threads trying
-		// to resume this thread will wait for the current fiber to switch away below
+		// `currentFiber` won't be published to a ready queue until it has switched away below though, so
+		// any other threads trying to resume it will leave that to us
 
 		// Now switch
-		m_taskScheduler->SwitchToFreeFiber(&currentFiber.FiberIsSwitched);
+		m_taskScheduler->SwitchToFreeFiber(&currentFiber);
 
 		FTL_ASSERT("pointers should be nulled after de-queue", currentFiber.Next == nullptr);
 		FTL_ASSERT("pointers should be nulled after de-queue", currentFiber.QueueTail == nullptr);
@@ -24,10 +24,16 @@
 
 #include "ftl/task_scheduler.h"
 
+#include "ftl/alloc.h"
+#include "ftl/asymmetric_fence.h"
 #include "ftl/callbacks.h"
 #include "ftl/thread_abstraction.h"
 #include "task_scheduler_internal.h"
 
+#include <algorithm>
+#include <chrono>
+#include <new>
+
 #if defined(FTL_OS_WINDOWS)
 #	ifndef WIN32_LEAN_AND_MEAN
 #		define WIN32_LEAN_AND_MEAN
@@ -41,26 +47,90 @@
 namespace ftl {
 
 constexpr static unsigned kFailedPopAttemptsHeuristic = 5;
+// The most items TakeOverflow() moves onto a thread's queue at once
+constexpr static size_t kOverflowBatchSize = 32;
 constexpr static int kInitErrorDoubleCall = -30;
 constexpr static int kInitErrorFailedToCreateWorkerThread = -60;
+constexpr static int kInitErrorInvalidFiberStackClasses = -70;
+constexpr static int kInitErrorEmptyAffinityCpus = -80;
+
+// EmptyQueueBehavior::Adaptive tuning. See TaskScheduler::AdaptiveIdle()
+constexpr static int64_t kAdaptiveMinSpinNs = 1000;
+constexpr static int64_t kAdaptiveMaxWakeLatencyNs = 1000000;
+constexpr static unsigned kAdaptiveSpinPauses = 16;
+
+static int64_t SteadyClockNs() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// xorshift32. Cheap, and plenty random enough to spread thieves out
+static uint32_t NextRandom(uint32_t *state) {
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+static size_t RoundUpToMultiple(size_t value, size_t multiple) {
+	return (value + multiple - 1) / multiple * multiple;
+}
 
 struct ThreadStartArgs {
 	TaskScheduler *Scheduler;
 	unsigned ThreadIndex;
 };
 
+/**
+ * The scheduler the current thread is bound to, and the thread's index within it
+ *
+ * This is written exactly once per thread, when the thread binds to the scheduler. It is only ever read from
+ * inside GetCurrentThreadIndex(), which is FTL_NOINLINE. So the compiler can't hoist the TLS address calculation
+ * above a fiber switch. See issue #57
+ */
+struct CurrentThreadSlot {
+	TaskScheduler const *Scheduler;
+	unsigned Index;
+};
+
+static thread_local CurrentThreadSlot tls_currentThread = { nullptr, 0 };
+
 FTL_THREAD_FUNC_RETURN_TYPE TaskScheduler::ThreadStartFunc(void *const arg) {
 	auto *const threadArgs = reinterpret_cast<ThreadStartArgs *>(arg);
 	TaskScheduler *taskScheduler = threadArgs->Scheduler;
 	unsigned const index = threadArgs->ThreadIndex;
-	SetCurrentThreadAffinity(index);
+	// Before anything else, so Init() doesn't return until we know whether it worked
+	ThreadPriorityOptions const &priority = taskScheduler->IsEfficiencyThread(index) ? taskScheduler->m_efficiencyWorkerPriority : taskScheduler->m_workerPriority;
+	if (priority.Policy != ThreadSchedulingPolicy::Normal || priority.Priority != 0) {
+		if (!SetCurrentThreadPriority(priority.Policy, priority.Priority)) {
+			taskScheduler->m_threadPriorityFailed.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	// The thread was pinned when it was created, so its storage is already on the right NUMA node
+	taskScheduler->CreateThreadLocalStorage(index);
+	tls_currentThread.Scheduler = taskScheduler;
+	tls_currentThread.Index = index;
 	// Clean up
 	delete threadArgs;
 
 	// Spin wait until everything is initialized
+	// Real-time threads sleep instead. If one shared a CPU with the main thread, the main thread would never get to finish Init()
+	bool const realtime = priority.Policy != ThreadSchedulingPolicy::Normal;
 	while (!taskScheduler->m_initialized.load(std::memory_order_acquire)) {
-		// Spin
-		FTL_PAUSE();
+		// Init() failed to create one of the other threads, and is waiting to join us
+		if (taskScheduler->m_initAborted.load(std::memory_order_acquire)) {
+			EndCurrentThread();
+			FTL_THREAD_FUNC_END;
+		}
+
+		if (realtime) {
+			SleepThread(1);
+		} else {
+			// Spin
+			FTL_PAUSE();
+		}
 	}
 
 	// Execute user thread start callback, if set
@@ -70,12 +140,12 @@ FTL_THREAD_FUNC_RETURN_TYPE TaskScheduler::ThreadStartFunc(void *const arg) {
 	}
 
 	// Get a free fiber to switch to
-	unsigned const freeFiberIndex = taskScheduler->GetNextFreeFiberIndex();
+	unsigned const freeFiberIndex = taskScheduler->GetNextFreeFiberIndex(taskScheduler->m_tls[index]);
 
 	// Initialize tls
-	taskScheduler->m_tls[index].CurrentFiberIndex = freeFiberIndex;
+	taskScheduler->m_tls[index]->CurrentFiberIndex = freeFiberIndex;
 	// Switch
-	taskScheduler->m_tls[index].ThreadFiber.SwitchToFiber(&taskScheduler->m_fibers[freeFiberIndex]);
+	taskScheduler->m_tls[index]->ThreadFiber.SwitchToFiber(&taskScheduler->m_fibers[freeFiberIndex]);
 
 	// And we've returned
 
@@ -89,14 +159,6 @@ FTL_THREAD_FUNC_RETURN_TYPE TaskScheduler::ThreadStartFunc(void *const arg) {
 	FTL_THREAD_FUNC_END;
 }
 
-// This Task is never used directly
-// However, a function pointer to it is the signal that the task is a Ready fiber, not a "real" task
-// See @FiberStartFunc() for more details
-static void ReadyFiberDummyTask(TaskScheduler *taskScheduler, void *arg) {
-	(void)taskScheduler;
-	(void)arg;
-}
-
 void TaskScheduler::FiberStartFunc(void *const arg) {
 	TaskScheduler *taskScheduler = reinterpret_cast<TaskScheduler *>(arg);
 
@@ -107,51 +169,99 @@ void TaskScheduler::FiberStartFunc(void *const arg) {
 	// If we just started from the pool, we may need to clean up from another fiber
 	taskScheduler->CleanUpOldFiber();
 
-	std::vector<TaskBundle> taskBuffer;
-
 	// Process tasks infinitely, until quit
 	while (!taskScheduler->m_quit.load(std::memory_order_acquire)) {
 		unsigned waitingFiberIndex = kInvalidIndex;
-		ThreadLocalStorage *tls = &taskScheduler->m_tls[taskScheduler->GetCurrentThreadIndex()];
+		ThreadLocalStorage *tls = taskScheduler->m_tls[taskScheduler->GetCurrentThreadIndex()];
 
-		bool readyWaitingFibers = false;
+		TaskBundle nextTask{};
+		bool foundTask = false;
 
-		// Check if there is a ready pinned waiting fiber
-		{
-			std::lock_guard<std::mutex> guard(tls->PinnedReadyFibersLock);
+		// If the previous fiber on this thread found a task that needed a bigger stack, it switched to us to run it
+		if (tls->HandoffTask.TaskToExecute.Function != nullptr) {
+			nextTask = tls->HandoffTask;
+			tls->HandoffTask = TaskBundle{};
+			foundTask = true;
+		}
 
-			for (auto bundle = tls->PinnedReadyFibers.begin(); bundle != tls->PinnedReadyFibers.end(); ++bundle) {
-				readyWaitingFibers = true;
+		// Check if there is a ready pinned waiting fiber
+		if (!foundTask) {
+			// Fibers are only published once they've been switched away from, so any of them can be resumed
+			WaitingFiberBundle *bundle = taskScheduler->PopPinnedReadyFiber(tls);
+			if (bundle != nullptr) {
+				waitingFiberIndex = bundle->FiberIndex;
+			}
+		}
 
-				if (!(*bundle)->FiberIsSwitched.load(std::memory_order_acquire)) {
-					// The wait condition is ready, but the "source" thread hasn't switched away from the fiber yet
-					// Skip this fiber until the next round
-					continue;
-				}
+		// Move any tasks other threads have handed us onto our own queues, so we can run them, and the others can steal them
+		if (waitingFiberIndex == kInvalidIndex && !foundTask) {
+			taskScheduler->TakeIncomingTasks(tls, tls);
+		}
 
-				waitingFiberIndex = (*bundle)->FiberIndex;
-				tls->PinnedReadyFibers.erase(bundle);
-				break;
+		// If the number of spinning threads is capped, only they can steal from the other threads
+		// Everyone else just works through their own queues, and goes to sleep once they're empty
+		bool steal = true;
+		if (taskScheduler->m_maxSpinningThreads != 0 && !tls->Spinning && waitingFiberIndex == kInvalidIndex && !foundTask) {
+			if (tls->ReadyFibers.Empty() && tls->HiPriTaskQueue.Empty() && (tls->LoPriTaskQueue.Empty() || tls->HighPriorityOnly)) {
+				steal = taskScheduler->StartSpinning(tls);
+			} else {
+				steal = false;
 			}
 		}
 
-		TaskBundle nextTask{};
-		bool foundTask = false;
+		// Threads on efficiency cores leave the other threads' ready fibers and high priority tasks to the performance cores
+		// They steal low priority work first, and only come back for the rest if it's still there after that
+		bool const stealUrgent = steal && (!tls->Efficiency || tls->HighPriorityOnly);
+
+		// Resuming a fiber comes before starting new tasks, even high priority ones
+		// It finishes work that's already in flight, and gives its fiber back to the pool sooner
+		if (waitingFiberIndex == kInvalidIndex && !foundTask) {
+			WaitingFiberBundle *bundle = taskScheduler->GetNextReadyFiber(stealUrgent);
+			if (bundle != nullptr) {
+				waitingFiberIndex = bundle->FiberIndex;
+			}
+		}
 
 		// If nothing was found, check if there is a high priority task to run
-		if (waitingFiberIndex == kInvalidIndex) {
-			foundTask = taskScheduler->GetNextHiPriTask(&nextTask, &taskBuffer);
+		if (waitingFiberIndex == kInvalidIndex && !foundTask) {
+			foundTask = taskScheduler->GetNextHiPriTask(&nextTask, stealUrgent);
+		}
+
+		// If we didn't find a high priority task, look for a low priority task
+		// Unless we're reserved for high priority work. Then we'd rather sit idle, so we're free the moment some shows up
+		if (waitingFiberIndex == kInvalidIndex && !foundTask && !tls->HighPriorityOnly) {
+			foundTask = taskScheduler->GetNextLoPriTask(&nextTask, steal);
+		}
 
-			// Check if the found task is a ReadyFiber dummy task
-			if (foundTask && nextTask.TaskToExecute.Function == ReadyFiberDummyTask) {
-				// Get the waiting fiber index
-				WaitingFiberBundle *bundle = reinterpret_cast<WaitingFiberBundle *>(nextTask.TaskToExecute.ArgData);
+		// There's no low priority work. So the performance cores are busy, or there's more urgent work than they can keep up with
+		if (waitingFiberIndex == kInvalidIndex && !foundTask && steal && !stealUrgent) {
+			WaitingFiberBundle *bundle = taskScheduler->GetNextReadyFiber(true);
+			if (bundle != nullptr) {
 				waitingFiberIndex = bundle->FiberIndex;
+			} else {
+				foundTask = taskScheduler->GetNextHiPriTask(&nextTask, true);
+			}
+		}
+
+		// If the task needs a bigger stack than ours, switch to a fiber that has one, and let it run the task
+		// We go back to the pool, just like when we switch to a ready waiting fiber
+		if (foundTask && waitingFiberIndex == kInvalidIndex && nextTask.StackClass > taskScheduler->GetFiberStackClass(tls->CurrentFiberIndex)) {
+			tls->HandoffTask = nextTask;
+			waitingFiberIndex = taskScheduler->GetNextFreeFiberIndex(tls, nextTask.StackClass);
+		}
+
+		if (foundTask || waitingFiberIndex != kInvalidIndex) {
+			// Let the adaptive spin budget learn from how long we waited
+			if (tls->IdleStartNs != 0) {
+				EndAdaptiveIdle(tls);
+			}
+			if (tls->Spinning) {
+				taskScheduler->StopSpinning(tls);
 			}
 		}
 
 		if (waitingFiberIndex != kInvalidIndex) {
-			// Found a waiting task that is ready to continue
+			// Found a waiting task that is ready to continue, or a fiber to hand a task to
 
 			tls->OldFiberIndex = tls->CurrentFiberIndex;
 			tls->CurrentFiberIndex = waitingFiberIndex;
@@ -173,17 +283,12 @@ void TaskScheduler::FiberStartFunc(void *const arg) {
 			taskScheduler->CleanUpOldFiber();
 
 			// Get a fresh instance of TLS, since we could be on a new thread now
-			tls = &taskScheduler->m_tls[taskScheduler->GetCurrentThreadIndex()];
+			tls = taskScheduler->m_tls[taskScheduler->GetCurrentThreadIndex()];
 
 			if (taskScheduler->m_emptyQueueBehavior.load(std::memory_order_relaxed) == EmptyQueueBehavior::Sleep) {
 				tls->FailedQueuePopAttempts = 0;
 			}
 		} else {
-			// If we didn't find a high priority task, look for a low priority task
-			if (!foundTask) {
-				foundTask = taskScheduler->GetNextLoPriTask(&nextTask);
-			}
-
 			EmptyQueueBehavior const behavior = taskScheduler->m_emptyQueueBehavior.load(std::memory_order_relaxed);
 
 			if (foundTask) {
@@ -197,6 +302,27 @@ void TaskScheduler::FiberStartFunc(void *const arg) {
 				}
 			} else {
 				// We failed to find a Task from any of the queues
+				// A thread that's busy with a long task can't get to the tasks handed to it. So we take them off its hands
+				// Reserved threads don't, since the batches could be low priority
+				if (steal && !tls->HighPriorityOnly && taskScheduler->StealIncomingTasks(tls)) {
+					continue;
+				}
+
+				// This is a good time to give back any extra fibers from a burst of waits
+				taskScheduler->TrimFiberPool();
+
+				// If we weren't allowed to look for work, there are already enough threads doing so. Leave it to them
+				if (!steal) {
+					taskScheduler->ParkCurrentThread();
+					continue;
+				}
+
+				// If we can't try every thread at once, try the ones we didn't get to next time
+				unsigned const numOthers = taskScheduler->m_numThreads - 1;
+				if (taskScheduler->m_stealAttempts < numOthers) {
+					tls->StealWindowOffset = (tls->StealWindowOffset + taskScheduler->m_stealAttempts) % numOthers;
+				}
+
 				// What we do now depends on m_emptyQueueBehavior, which we loaded above
 				switch (behavior) {
 				case EmptyQueueBehavior::Yield:
@@ -204,28 +330,19 @@ void TaskScheduler::FiberStartFunc(void *const arg) {
 					break;
 
 				case EmptyQueueBehavior::Sleep: {
-					// If we have a ready waiting fiber, prevent sleep
-					if (!readyWaitingFibers) {
-						++tls->FailedQueuePopAttempts;
-						// Go to sleep if we've failed to find a task kFailedPopAttemptsHeuristic times
-						if (tls->FailedQueuePopAttempts >= kFailedPopAttemptsHeuristic) {
-							std::unique_lock<std::mutex> lock(taskScheduler->ThreadSleepLock);
-							// Acquire the pinned ready fibers lock here and check if there are any pinned fibers ready
-							// Acquiring the lock here prevents a race between readying a pinned fiber (on another thread) and going to sleep
-							// Either this thread wins, then notify_*() will wake it
-							// Or the other thread wins, then this thread will observe the pinned fiber, and will not go to sleep
-							std::unique_lock<std::mutex> readyfiberslock(tls->PinnedReadyFibersLock);
-							if (tls->PinnedReadyFibers.empty()) {
-								// Unlock before going to sleep (the other lock is released by the CV wait)
-								readyfiberslock.unlock();
-								taskScheduler->ThreadSleepCV.wait(lock);
-							}
-							tls->FailedQueuePopAttempts = 0;
-						}
+					++tls->FailedQueuePopAttempts;
+					// Go to sleep if we've failed to find a task kFailedPopAttemptsHeuristic times
+					if (tls->FailedQueuePopAttempts >= kFailedPopAttemptsHeuristic) {
+						taskScheduler->ParkCurrentThread();
+						tls->FailedQueuePopAttempts = 0;
 					}
 
 					break;
 				}
+				case EmptyQueueBehavior::Adaptive:
+					taskScheduler->AdaptiveIdle(tls);
+					break;
+
 				case EmptyQueueBehavior::Spin:
 				default:
 					// Just fall through and continue the next loop
@@ -242,7 +359,7 @@ void TaskScheduler::FiberStartFunc(void *const arg) {
 	}
 
 	unsigned index = taskScheduler->GetCurrentThreadIndex();
-	taskScheduler->m_fibers[taskScheduler->m_tls[index].CurrentFiberIndex].SwitchToFiber(&taskScheduler->m_quitFibers[index]);
+	taskScheduler->m_fibers[taskScheduler->m_tls[index]->CurrentFiberIndex].SwitchToFiber(&taskScheduler->m_quitFibers[index]);
 
 	// We should never get here
 	printf("Error: FiberStart should never return");
@@ -264,7 +381,7 @@ void TaskScheduler::ThreadEndFunc(void *arg) {
 		// Special case for the main thread fiber
 		taskScheduler->m_quitFibers[threadIndex].SwitchToFiber(&taskScheduler->m_fibers[0]);
 	} else {
-		taskScheduler->m_quitFibers[threadIndex].SwitchToFiber(&taskScheduler->m_tls[threadIndex].ThreadFiber);
+		taskScheduler->m_quitFibers[threadIndex].SwitchToFiber(&taskScheduler->m_tls[threadIndex]->ThreadFiber);
 	}
 
 	// We should never get here
@@ -273,6 +390,7 @@ void TaskScheduler::ThreadEndFunc(void *arg) {
 
 TaskScheduler::TaskScheduler() {
 	FTL_VALGRIND_HG_DISABLE_CHECKING(&m_initialized, sizeof(m_initialized));
+	FTL_VALGRIND_HG_DISABLE_CHECKING(&m_initAborted, sizeof(m_initAborted));
 	FTL_VALGRIND_HG_DISABLE_CHECKING(&m_quit, sizeof(m_quit));
 	FTL_VALGRIND_HG_DISABLE_CHECKING(&m_quitCount, sizeof(m_quitCount));
 }
@@ -282,42 +400,184 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 	if (m_initialized.load()) {
 		return kInitErrorDoubleCall;
 	}
+	// There's nothing to pin the threads to. Rather than guess, let the user know
+	if (options.Pinning == ThreadPinning::CpuList && options.AffinityCpus.empty()) {
+		return kInitErrorEmptyAffinityCpus;
+	}
 
 	m_callbacks = options.Callbacks;
 
 	// Initialize the flags
 	m_emptyQueueBehavior.store(options.Behavior);
+	m_maxSpinningThreads = options.MaxSpinningThreads;
+	m_spreadTasksThreshold = options.SpreadTasksThreshold;
+	m_victimSelection = options.VictimSelection;
+	m_workerPriority = options.WorkerPriority;
+	m_efficiencyWorkerPriority = options.EfficiencyWorkerPriority;
+	m_threadPriorityFailed.store(false, std::memory_order_relaxed);
+	m_asymmetricQueueFences = options.AsymmetricQueueFences && EnableAsymmetricFences();
+
+	// Work out which CPUs we can use. Inside a container, that can be far fewer than the machine has
+	std::vector<CpuInfo> const topology = GetCpuTopology();
+	m_mainThreadCpus = GetCurrentThreadAllowedCpus();
+	m_pinThreads = options.Pinning != ThreadPinning::None;
+
+	std::vector<CpuInfo> cpus;
+	if (options.Pinning == ThreadPinning::CpuList) {
+		// Exactly where we were told. CPUs the topology doesn't know about are treated as separate cores
+		for (unsigned const id : options.AffinityCpus) {
+			auto const cpu = std::find_if(topology.begin(), topology.end(), [id](CpuInfo const &info) { return info.Id == id; });
+			cpus.push_back(cpu != topology.end() ? *cpu : CpuInfo{ id, id, 0, 0, 0, kMaxCpuCapacity });
+		}
+	} else {
+		// Place the threads deliberately. Physical cores first, with threads that share a cache next to each other
+		for (CpuInfo const &cpu : topology) {
+			if (std::find(m_mainThreadCpus.begin(), m_mainThreadCpus.end(), cpu.Id) != m_mainThreadCpus.end()) {
+				cpus.push_back(cpu);
+			}
+		}
+		if (cpus.empty()) {
+			cpus = topology;
+		}
+		cpus = OrderCpusForPlacement(cpus);
+	}
 
 	if (options.ThreadPoolSize == 0) {
-		// 1 thread for each logical processor
-		m_numThreads = GetNumHardwareThreads();
+		// 1 thread for each CPU we can use. But no more than our quota, or the extra threads will just get throttled
+		m_numThreads = static_cast<unsigned>(cpus.size());
+		unsigned const quota = GetCpuQuota();
+		if (quota != 0 && quota < m_numThreads) {
+			m_numThreads = quota;
+		}
 	} else {
 		m_numThreads = options.ThreadPoolSize;
 	}
 
-	// Create and populate the fiber pool
-	m_fiberPoolSize = options.FiberPoolSize;
-	m_fibers = new Fiber[options.FiberPoolSize];
-	m_freeFibers = new std::atomic<bool>[options.FiberPoolSize];
-	FTL_VALGRIND_HG_DISABLE_CHECKING(m_freeFibers, sizeof(std::atomic<bool>) * m_fiberPoolSize);
+	// The main thread is never reserved, so there's always someone to run low priority tasks
+	m_numReservedThreads = std::min(options.ReservedHighPriorityThreads, m_numThreads - 1);
 
-	// Leave the first slot for the bound main thread
-	for (unsigned i = 1; i < options.FiberPoolSize; ++i) {
-		m_fibers[i] = Fiber(524288, FiberStartFunc, this);
-		m_freeFibers[i].store(true, std::memory_order_release);
+	// If there are more threads than CPUs, we wrap around
+	m_threadCpus.resize(m_numThreads);
+	m_multipleNodes = false;
+	m_maxThreadCapacity = 0;
+	for (unsigned i = 0; i < m_numThreads; ++i) {
+		m_threadCpus[i] = cpus[i % cpus.size()];
+		// Unpinned threads can be anywhere, so there's no point placing memory for them
+		if (m_pinThreads && m_threadCpus[i].NodeId != m_threadCpus[0].NodeId) {
+			m_multipleNodes = true;
+		}
+		m_maxThreadCapacity = std::max(m_maxThreadCapacity, m_threadCpus[i].Capacity);
 	}
-	m_freeFibers[0].store(false, std::memory_order_release);
+
+	// Each thread steals from the closest threads first. Within each ring, it starts with the next thread along,
+	// rather than the lowest index, so the threads don't all pile onto the same one
+	m_stealOrder.clear();
+	m_stealOrder.reserve(static_cast<size_t>(m_numThreads) * (m_numThreads - 1));
+	for (unsigned i = 0; i < m_numThreads; ++i) {
+		for (unsigned offset = 1; offset < m_numThreads; ++offset) {
+			m_stealOrder.push_back((i + offset) % m_numThreads);
+		}
+		std::stable_sort(m_stealOrder.end() - (m_numThreads - 1), m_stealOrder.end(), [this, i](unsigned a, unsigned b) {
+			return CpuDistance(m_threadCpus[i], m_threadCpus[a]) < CpuDistance(m_threadCpus[i], m_threadCpus[b]);
+		});
+	}
+
+	// Sanity check the stack classes. They have to get bigger, so "at least class N" means the same as "N or higher"
+	// And every class needs at least one fiber. Otherwise, a task that asks for it could never run
+	// Class 0 also needs its first slot up front, since that is where the main thread fiber lives
+	if (options.FiberPoolSize == 0) {
+		return kInitErrorInvalidFiberStackClasses;
+	}
+	for (size_t i = 0; i < options.ExtraFiberStackClasses.size(); ++i) {
+		FiberStackClassOptions const &classOptions = options.ExtraFiberStackClasses[i];
+		size_t const previousStackSize = i == 0 ? options.FiberStackSize : options.ExtraFiberStackClasses[i - 1].StackSize;
+		if (classOptions.StackSize <= previousStackSize || std::max(classOptions.PoolSize, classOptions.MaxPoolSize) == 0) {
+			return kInitErrorInvalidFiberStackClasses;
+		}
+	}
+
+	m_fiberPoolGrowthSize = std::max(options.FiberPoolGrowthSize, 1U);
+	m_fiberPoolTrimDelayNs = static_cast<int64_t>(options.FiberPoolTrimDelayMs) * 1000000;
+	size_t const pageSize = SystemPageSize();
+	m_fiberStackRetainSize = RoundUpToMultiple(options.FiberStackRetainSize, pageSize);
+
+	// Class 0 is described by the "legacy" options
+	std::vector<FiberStackClassOptions> classOptions;
+	classOptions.reserve(1 + options.ExtraFiberStackClasses.size());
+	FiberStackClassOptions defaultClassOptions;
+	defaultClassOptions.StackSize = options.FiberStackSize;
+	defaultClassOptions.PoolSize = options.FiberPoolSize;
+	defaultClassOptions.MaxPoolSize = options.MaxFiberPoolSize;
+	classOptions.push_back(defaultClassOptions);
+	classOptions.insert(classOptions.end(), options.ExtraFiberStackClasses.begin(), options.ExtraFiberStackClasses.end());
+
+	// Give each class a contiguous range of m_fibers
+	m_numStackClasses = static_cast<unsigned>(classOptions.size());
+	m_stackClasses = new FiberStackClass[m_numStackClasses];
+	m_fiberSlotCount = 0;
+	for (unsigned i = 0; i < m_numStackClasses; ++i) {
+		FiberStackClass &stackClass = m_stackClasses[i];
+		stackClass.FirstFiberIndex = m_fiberSlotCount;
+		stackClass.MinFibers = classOptions[i].PoolSize;
+		stackClass.MaxFibers = std::max(classOptions[i].PoolSize, classOptions[i].MaxPoolSize);
+		m_fiberSlotCount += stackClass.MaxFibers;
+	}
+
+	// Let each thread cache up to a quarter of its "fair share" of the pool
+	// Each thread starts with its cache full. See GetFiberHomeNode()
+	m_fiberCacheCapacity = std::min(kFiberCacheCapacity, m_stackClasses[0].MinFibers / (m_numThreads * 4));
+
+	// The fibers are default constructed, so slots past the PoolSize of each class don't cost anything until the class grows into them
+	m_fibers = new Fiber[m_fiberSlotCount];
+	m_deepFibers = new bool[m_fiberSlotCount]();
+
+	for (unsigned i = 0; i < m_numStackClasses; ++i) {
+		FiberStackClass &stackClass = m_stackClasses[i];
+
+		// Reserve the address space for all the stacks up front. Each slot is [guard page][stack]
+		// Slot 0 belongs to the main thread fiber, which has its own stack, so it is never committed
+		stackClass.StackSize = RoundUpToMultiple(std::max<size_t>(classOptions[i].StackSize, pageSize), pageSize);
+		stackClass.StackStride = pageSize + stackClass.StackSize;
+		stackClass.StackArenaSize = stackClass.StackStride * stackClass.MaxFibers;
+		stackClass.StackArena = static_cast<char *>(MemoryReserve(stackClass.StackArenaSize));
+
+		// LockFreeIndexStack is indexed by the fiber index, so it has to cover all of m_fibers
+		stackClass.FreeFibers = new LockFreeIndexStack(m_fiberSlotCount);
+
+		// Leave the first slot of class 0 for the bound main thread
+		// Then the threads' initial fiber caches. They're handed out in CreateThreadLocalStorage()
+		unsigned const firstPoolFiber = i == 0 ? 1 : 0;
+		unsigned const firstSharedFiber = i == 0 ? 1 + m_numThreads * m_fiberCacheCapacity : 0;
+		std::vector<unsigned> freeFiberIndices;
+		freeFiberIndices.reserve(stackClass.MinFibers);
+		for (unsigned j = firstPoolFiber; j < stackClass.MinFibers; ++j) {
+			CreatePoolFiber(&stackClass, stackClass.FirstFiberIndex + j);
+			if (j >= firstSharedFiber) {
+				freeFiberIndices.push_back(stackClass.FirstFiberIndex + j);
+			}
+		}
+		// Push them all at once. The pool is LIFO, so the lowest indices will be handed out first
+		stackClass.FreeFibers->PushMany(freeFiberIndices.data(), static_cast<unsigned>(freeFiberIndices.size()));
+
+		stackClass.SlotsUsed = stackClass.MinFibers;
+		stackClass.CommittedFibers.store(stackClass.MinFibers, std::memory_order_relaxed);
+		stackClass.Stats.PeakCommittedFibers = stackClass.MinFibers;
+	}
+
+	m_idleThreads = new LockFreeIndexStack(m_numThreads);
+	m_idleEfficiencyThreads = new LockFreeIndexStack(m_numThreads);
+	m_idleReservedThreads = new LockFreeIndexStack(m_numThreads);
 
 	// Initialize threads and TLS
+	// Each thread creates its own ThreadLocalStorage. See CreateThreadLocalStorage()
 	m_threads = new ThreadType[m_numThreads];
-#ifdef _MSC_VER
-#	pragma warning(push)
-#	pragma warning(disable : 4316) // I know this won't be allocated to the right alignment, this is okay as we're using alignment for padding.
-#endif                              // _MSC_VER
-	m_tls = new ThreadLocalStorage[m_numThreads];
-#ifdef _MSC_VER
-#	pragma warning(pop)
-#endif // _MSC_VER
+	m_tls = new ThreadLocalStorage *[m_numThreads]();
+	m_tlsCreated.store(0, std::memory_order_relaxed);
+
+	m_stealAttempts = m_numThreads - 1;
+	if (options.MaxStealAttempts != 0 && options.MaxStealAttempts < m_stealAttempts) {
+		m_stealAttempts = options.MaxStealAttempts;
+	}
 
 #if defined(FTL_WIN32_THREADS)
 	// Temporarily set the main thread ID to -1, so when the worker threads start up, they don't accidentally use it
@@ -329,14 +589,19 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 		m_callbacks.OnThreadsCreated(m_callbacks.Context, m_numThreads);
 	}
 	if (m_callbacks.OnFibersCreated != nullptr) {
-		m_callbacks.OnFibersCreated(m_callbacks.Context, options.FiberPoolSize);
+		m_callbacks.OnFibersCreated(m_callbacks.Context, GetFiberCount());
 	}
 
 	// Set the properties for the main thread
 	
-	SetCurrentThreadAffinity(0);
+	if (m_pinThreads) {
+		SetCurrentThreadAffinity(m_threadCpus[0].Id);
+	}
+	CreateThreadLocalStorage(0);
 
 	m_threads[0] = GetCurrentThread();
+	tls_currentThread.Scheduler = this;
+	tls_currentThread.Index = 0;
 #if defined(FTL_WIN32_THREADS)
 	// Set the thread handle to INVALID_HANDLE_VALUE
 	// ::GetCurrentThread is a pseudo handle, that always references the current thread.
@@ -348,7 +613,7 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 #endif
 
 	// Set the fiber index
-	m_tls[0].CurrentFiberIndex = 0;
+	m_tls[0]->CurrentFiberIndex = 0;
 
 	// Create the worker threads
 	for (unsigned i = 1; i < m_numThreads; ++i) {
@@ -357,9 +622,21 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 		threadArgs->ThreadIndex = i;
 
 		char threadName[256];
-		snprintf(threadName, sizeof(threadName), "FTL Worker Thread %u", i);
-
-		if (!CreateThread(524288, ThreadStartFunc, threadArgs, threadName, &m_threads[i])) {
+		// Short enough that Linux doesn't truncate the number. It only keeps 15 characters
+		snprintf(threadName, sizeof(threadName), "FTL Worker %u", i);
+
+		// Pin the thread as it's created, so it never runs anywhere else
+		bool const created = m_pinThreads ? CreateThread(524288, ThreadStartFunc, threadArgs, threadName, m_threadCpus[i].Id, &m_threads[i])
+		                                  : CreateThread(524288, ThreadStartFunc, threadArgs, threadName, &m_threads[i]);
+		if (!created) {
+			delete threadArgs;
+
+			// The threads we did create are already running against us. Stop them before they can start any fibers
+			m_initAborted.store(true, std::memory_order_release);
+			for (unsigned j = 1; j < i; ++j) {
+				JoinThread(m_threads[j]);
+			}
+			tls_currentThread.Scheduler = nullptr;
 			return kInitErrorFailedToCreateWorkerThread;
 		}
 	}
@@ -369,6 +646,11 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 		m_callbacks.OnFiberAttached(m_callbacks.Context, 0);
 	}
 
+	// Wait for the worker threads to create their ThreadLocalStorage. Everyone needs to see everyone else's
+	while (m_tlsCreated.load(std::memory_order_acquire) < m_numThreads) {
+		YieldThread();
+	}
+
 	// Signal the worker threads that we're fully initialized
 	m_initialized.store(true, std::memory_order_release);
 
@@ -376,6 +658,46 @@ int TaskScheduler::Init(TaskSchedulerInitOptions options) {
 }
 
 TaskScheduler::~TaskScheduler() {
+	// Init() was never called, or it failed. There are no fibers to quit from, and it already joined any threads it created
+	if (m_initialized.load(std::memory_order_acquire)) {
+		QuitThreads();
+	}
+
+	// Let the main thread run wherever it could before we pinned it
+	if (m_pinThreads && !m_mainThreadCpus.empty()) {
+		SetCurrentThreadAllowedCpus(m_mainThreadCpus);
+	}
+
+	// Cleanup
+	// Init() may have failed before it got as far as the thread storage
+	for (unsigned i = 0; m_tls != nullptr && i < m_numThreads; ++i) {
+		// A thread that failed to start never created its storage
+		if (m_tls[i] == nullptr) {
+			continue;
+		}
+
+		m_tls[i]->~ThreadLocalStorage();
+		AlignedFree(m_tls[i]);
+	}
+	delete[] m_tls;
+	delete[] m_threads;
+	delete m_idleThreads;
+	delete m_idleEfficiencyThreads;
+	delete m_idleReservedThreads;
+	delete[] m_fibers;
+	delete[] m_deepFibers;
+	for (unsigned i = 0; i < m_numStackClasses; ++i) {
+		delete m_stackClasses[i].FreeFibers;
+		if (m_stackClasses[i].StackArena != nullptr) {
+			MemoryReserveRelease(m_stackClasses[i].StackArena, m_stackClasses[i].StackArenaSize);
+		}
+	}
+	delete[] m_stackClasses;
+
+	delete[] m_quitFibers;
+}
+
+void TaskScheduler::QuitThreads() {
 	// Create the quit fibers
 	m_quitFibers = new Fiber[m_numThreads];
 	for (unsigned i = 0; i < m_numThreads; ++i) {
@@ -385,9 +707,10 @@ TaskScheduler::~TaskScheduler() {
 	// Request that all the threads quit
 	m_quit.store(true, std::memory_order_release);
 
-	// Signal any waiting threads so they can finish
-	if (m_emptyQueueBehavior.load(std::memory_order_relaxed) == EmptyQueueBehavior::Sleep) {
-		ThreadSleepCV.notify_all();
+	// Wake any sleeping threads so they can finish
+	// We don't check the behavior, since it could have been changed while threads were asleep
+	for (unsigned i = 0; i < m_numThreads; ++i) {
+		WakeThread(i);
 	}
 
 	// Jump to the quit fiber
@@ -398,76 +721,215 @@ TaskScheduler::~TaskScheduler() {
 		}
 
 		unsigned index = GetCurrentThreadIndex();
-		m_fibers[m_tls[index].CurrentFiberIndex].SwitchToFiber(&m_quitFibers[index]);
+		m_fibers[m_tls[index]->CurrentFiberIndex].SwitchToFiber(&m_quitFibers[index]);
 	}
 
 	// We're back. We should be on the main thread now
+	if (tls_currentThread.Scheduler == this) {
+		tls_currentThread.Scheduler = nullptr;
+	}
 
 	// Wait for the worker threads to finish
 	for (unsigned i = 1; i < m_numThreads; ++i) {
 		JoinThread(m_threads[i]);
 	}
-
-	// Cleanup
-	delete[] m_tls;
-	delete[] m_threads;
-	delete[] m_freeFibers;
-	delete[] m_fibers;
-
-	delete[] m_quitFibers;
 }
 
-void TaskScheduler::AddTask(Task task, TaskPriority priority, WaitGroup *waitGroup) {
+void TaskScheduler::AddTask(Task task, TaskPriority priority, WaitGroup *waitGroup, unsigned stackClass) {
 	FTL_ASSERT("Task given to TaskScheduler:AddTask has a nullptr Function", task.Function != nullptr);
+	FTL_ASSERT("Task given to TaskScheduler:AddTask has an unknown stack class", stackClass < m_numStackClasses);
 
 	if (waitGroup != nullptr) {
 		waitGroup->Add(1);
 	}
 
-	const TaskBundle bundle = { task, waitGroup };
+	const TaskBundle bundle = { task, waitGroup, stackClass };
+	ThreadLocalStorage *tls = m_tls[GetCurrentThreadIndex()];
+	auto const getBundle = [&](size_t) {
+		return bundle;
+	};
 	if (priority == TaskPriority::High) {
-		m_tls[GetCurrentThreadIndex()].HiPriTaskQueue.Push(bundle);
+		PushOrSpill(&tls->HiPriTaskQueue, &m_hiPriOverflow, 1, getBundle);
 	} else if (priority == TaskPriority::Normal) {
-		m_tls[GetCurrentThreadIndex()].LoPriTaskQueue.Push(bundle);
+		if (tls->HighPriorityOnly) {
+			// We never run low priority tasks, and the other threads may never get round to stealing from us. Put it where any of them can find it
+			Spill(&m_loPriOverflow, 0, 1, getBundle);
+		} else {
+			PushOrSpill(&tls->LoPriTaskQueue, &m_loPriOverflow, 1, getBundle);
+		}
 	}
 
-	const EmptyQueueBehavior behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
-	if (behavior == EmptyQueueBehavior::Sleep) {
+	if (ThreadsCanPark()) {
 		// Wake a sleeping thread
-		ThreadSleepCV.notify_one();
+		WakeIdleThreads(1, priority == TaskPriority::High);
 	}
 }
 
-void TaskScheduler::AddTasks(uint32_t numTasks, Task *tasks, TaskPriority priority, WaitGroup *waitGroup) {
+void TaskScheduler::AddTasks(uint32_t numTasks, Task *tasks, TaskPriority priority, WaitGroup *waitGroup, unsigned stackClass) {
+	FTL_ASSERT("Tasks given to TaskScheduler:AddTasks have an unknown stack class", stackClass < m_numStackClasses);
+
 	if (waitGroup != nullptr) {
 		waitGroup->Add(static_cast<int32_t>(numTasks));
 	}
 
-	WaitFreeQueue<TaskBundle> *queue = nullptr;
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	WaitFreeQueue<TaskBundle, kTaskQueueCapacity> *queue = nullptr;
+	OverflowQueue<TaskBundle> *overflow = nullptr;
 	if (priority == TaskPriority::High) {
-		queue = &m_tls[GetCurrentThreadIndex()].HiPriTaskQueue;
+		queue = &m_tls[currentThreadIndex]->HiPriTaskQueue;
+		overflow = &m_hiPriOverflow;
 	} else if (priority == TaskPriority::Normal) {
-		queue = &m_tls[GetCurrentThreadIndex()].LoPriTaskQueue;
+		queue = &m_tls[currentThreadIndex]->LoPriTaskQueue;
+		overflow = &m_loPriOverflow;
 	} else {
 		FTL_ASSERT("Unknown task priority", false);
 		return;
 	}
-	for (unsigned i = 0; i < numTasks; ++i) {
+
+	// Other threads can only steal from our queue one task at a time, so a big batch would take a while to fan out
+	// Instead, we split it evenly up front, and hand each thread its share directly. We keep the first share
+	// Low priority tasks aren't given to the threads reserved for high priority work. If we're one of them, our share goes to the overflow queue
+	unsigned const numSharers = priority == TaskPriority::Normal ? m_numThreads - m_numReservedThreads + (m_tls[currentThreadIndex]->HighPriorityOnly ? 1 : 0) : m_numThreads;
+	bool const spread = m_spreadTasksThreshold != 0 && numTasks >= m_spreadTasksThreshold && numSharers > 1;
+	if (spread) {
+		unsigned const shareSize = (numTasks + numSharers - 1) / numSharers;
+		bool const threadsCanPark = ThreadsCanPark();
+
+		for (unsigned first = shareSize, offset = 1; first < numTasks; first += shareSize, ++offset) {
+			unsigned const count = std::min(shareSize, numTasks - first);
+			while (priority == TaskPriority::Normal && m_tls[(currentThreadIndex + offset) % m_numThreads]->HighPriorityOnly) {
+				++offset;
+			}
+
+			unsigned const threadIndex = (currentThreadIndex + offset) % m_numThreads;
+			PushIncomingTasks(m_tls[threadIndex], priority, count, [=](size_t i) {
+				FTL_ASSERT("Task given to TaskScheduler:AddTasks has a nullptr Function", tasks[first + i].Function != nullptr);
+				return TaskBundle{ tasks[first + i], waitGroup, stackClass };
+			});
+			if (threadsCanPark) {
+				WakeThread(threadIndex);
+			}
+		}
+
+		numTasks = shareSize;
+	}
+
+	// Publish them all at once, rather than fencing for each task
+	auto const getBundle = [=](size_t i) {
 		FTL_ASSERT("Task given to TaskScheduler:AddTasks has a nullptr Function", tasks[i].Function != nullptr);
-		const TaskBundle bundle = { tasks[i], waitGroup };
-		queue->Push(bundle);
+		return TaskBundle{ tasks[i], waitGroup, stackClass };
+	};
+	if (priority == TaskPriority::Normal && m_tls[currentThreadIndex]->HighPriorityOnly) {
+		// We never run low priority tasks. See AddTask()
+		Spill(overflow, 0, numTasks, getBundle);
+	} else {
+		PushOrSpill(queue, overflow, numTasks, getBundle);
 	}
 
-	const EmptyQueueBehavior behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
-	if (behavior == EmptyQueueBehavior::Sleep) {
-		// Wake all the threads
-		ThreadSleepCV.notify_all();
+	// If we spread the batch, every other thread has already been woken with its own share
+	if (!spread && ThreadsCanPark()) {
+		// Wake one sleeping thread per task, at most
+		WakeIdleThreads(numTasks, priority == TaskPriority::High);
 	}
 }
 
-#if defined(FTL_WIN32_THREADS)
+template <TaskPriority Priority>
+void TaskScheduler::RangeTaskStartFunc(TaskScheduler *taskScheduler, void *arg) {
+	RangeTask *range = static_cast<RangeTask *>(arg);
+
+	size_t grain = range->Grain;
+	if (grain == 0) {
+		// Small enough that the threads can share the range evenly, big enough that the per chunk overhead doesn't matter
+		grain = std::max<size_t>(1, (range->End - range->Begin) / (taskScheduler->m_numThreads * kRangeTaskChunksPerThread));
+	}
+	taskScheduler->RunRangeTask(range, range->Begin, range->End, grain, Priority);
+}
+
+void TaskScheduler::RangeSplitStartFunc(TaskScheduler *taskScheduler, void *arg) {
+	RangeSplit *split = static_cast<RangeSplit *>(arg);
+
+	// The thread that split it off may have got to it first
+	if (split->Claimed.exchange(true, std::memory_order_acq_rel)) {
+		return;
+	}
+	taskScheduler->RunRangeTask(split->Range, split->Begin, split->End, split->Grain, split->Priority);
+}
+
+void TaskScheduler::AddRangeTask(RangeTask *task, TaskPriority priority, WaitGroup *waitGroup) {
+	FTL_ASSERT("RangeTask given to TaskScheduler:AddRangeTask has a nullptr Function", task->Function != nullptr);
+
+	if (task->Begin >= task->End) {
+		return;
+	}
+
+	Task const wrapper = { priority == TaskPriority::High ? RangeTaskStartFunc<TaskPriority::High> : RangeTaskStartFunc<TaskPriority::Normal>, task };
+	AddTask(wrapper, priority, waitGroup);
+}
+
+void TaskScheduler::RunRangeTask(RangeTask *range, size_t begin, size_t end, size_t grain, TaskPriority priority) {
+	// The halves we split off. They stay here, so splitting doesn't allocate. We wait for them before returning
+	RangeSplit splits[kMaxRangeSplits];
+	unsigned numSplits = 0;
+	WaitGroup children(this);
+
+	for (;;) {
+		while (begin < end) {
+			// Only split while our queue is empty. Otherwise, there's already work here for other threads to steal
+			// Look up the thread every time, since Function can wait, and come back on a different one
+			if (m_numThreads > 1 && numSplits < kMaxRangeSplits && end - begin >= 2 * grain) {
+				ThreadLocalStorage const *tls = m_tls[GetCurrentThreadIndex()];
+				if ((priority == TaskPriority::High ? tls->HiPriTaskQueue : tls->LoPriTaskQueue).Empty()) {
+					size_t const mid = begin + (end - begin) / 2;
+
+					RangeSplit &split = splits[numSplits++];
+					split.Range = range;
+					split.Begin = mid;
+					split.End = end;
+					split.Grain = grain;
+					split.Priority = priority;
+					split.Claimed.store(false, std::memory_order_relaxed);
+					AddTask({ RangeSplitStartFunc, &split }, priority, &children);
+
+					end = mid;
+				}
+			}
+
+			size_t const chunkEnd = end - begin > grain ? begin + grain : end;
+			range->Function(this, range->ArgData, begin, chunkEnd);
+			begin = chunkEnd;
+		}
+
+		// Carry on with a half nobody stole. The newest are the smallest, and the most likely to still be in our queue
+		// We loop rather than recurse, so a range task only ever has one splits array on the fiber stack
+		unsigned i = numSplits;
+		while (i > 0 && (splits[i - 1].Claimed.load(std::memory_order_relaxed) || splits[i - 1].Claimed.exchange(true, std::memory_order_acq_rel))) {
+			--i;
+		}
+		if (i == 0) {
+			break;
+		}
+		begin = splits[i - 1].Begin;
+		end = splits[i - 1].End;
+	}
+
+	// Even the halves we ran are still queued somewhere, pointing at splits. Wait for them to be popped
+	children.Wait();
+}
 
 FTL_NOINLINE unsigned TaskScheduler::GetCurrentThreadIndex() const {
+	CurrentThreadSlot const &slot = tls_currentThread;
+	if (slot.Scheduler == this) {
+		return slot.Index;
+	}
+
+	// The thread is bound to a different scheduler (or none at all)
+	// For example, when multiple schedulers share the same "main" thread
+	return FindCurrentThreadIndex();
+}
+
+#if defined(FTL_WIN32_THREADS)
+
+unsigned TaskScheduler::FindCurrentThreadIndex() const {
 	DWORD const threadId = ::GetCurrentThreadId();
 	for (unsigned i = 0; i < m_numThreads; ++i) {
 		if (m_threads[i].Id == threadId) {
@@ -480,7 +942,7 @@ FTL_NOINLINE unsigned TaskScheduler::GetCurrentThreadIndex() const {
 
 #elif defined(FTL_POSIX_THREADS)
 
-FTL_NOINLINE unsigned TaskScheduler::GetCurrentThreadIndex() const {
+unsigned TaskScheduler::FindCurrentThreadIndex() const {
 	pthread_t const currentThread = pthread_self();
 	for (unsigned i = 0; i < m_numThreads; ++i) {
 		if (pthread_equal(currentThread, m_threads[i]) != 0) {
@@ -494,137 +956,713 @@ FTL_NOINLINE unsigned TaskScheduler::GetCurrentThreadIndex() const {
 #endif
 
 unsigned TaskScheduler::GetCurrentFiberIndex() const {
-	ThreadLocalStorage &tls = m_tls[GetCurrentThreadIndex()];
+	ThreadLocalStorage &tls = *m_tls[GetCurrentThreadIndex()];
 	return tls.CurrentFiberIndex;
 }
 
-inline bool TaskScheduler::TaskIsReadyToExecute(TaskBundle *bundle) const {
-	// "Real" tasks are always ready to execute
-	if (bundle->TaskToExecute.Function != ReadyFiberDummyTask) {
-		return true;
+void TaskScheduler::PushPinnedReadyFiber(ThreadLocalStorage *tls, WaitingFiberBundle *bundle) {
+	WaitingFiberBundle *head = tls->PinnedReadyFibersHead.load(std::memory_order_relaxed);
+	do {
+		bundle->Next = head;
+	} while (!tls->PinnedReadyFibersHead.compare_exchange_weak(head, bundle, std::memory_order_release, std::memory_order_relaxed));
+}
+
+WaitingFiberBundle *TaskScheduler::PopPinnedReadyFiber(ThreadLocalStorage *tls) {
+	if (tls->PinnedReadyFibers == nullptr) {
+		// Cheap check first, so the common case doesn't dirty the cache line
+		if (tls->PinnedReadyFibersHead.load(std::memory_order_relaxed) == nullptr) {
+			return nullptr;
+		}
+
+		// Take everything at once. We're the only consumer, so there's no ABA problem
+		WaitingFiberBundle *bundle = tls->PinnedReadyFibersHead.exchange(nullptr, std::memory_order_acquire);
+
+		// The stack is newest first. Reverse it, so fibers are resumed in the order they were readied
+		WaitingFiberBundle *oldestFirst = nullptr;
+		while (bundle != nullptr) {
+			WaitingFiberBundle *next = bundle->Next;
+			bundle->Next = oldestFirst;
+			oldestFirst = bundle;
+			bundle = next;
+		}
+		tls->PinnedReadyFibers = oldestFirst;
 	}
 
-	// If it's a ready fiber task, the arg is a WaitingFiberBundle
-	WaitingFiberBundle *waitingFiberBundle = reinterpret_cast<WaitingFiberBundle *>(bundle->TaskToExecute.ArgData);
-	return waitingFiberBundle->FiberIsSwitched.load(std::memory_order_acquire);
+	WaitingFiberBundle *bundle = tls->PinnedReadyFibers;
+	if (bundle != nullptr) {
+		tls->PinnedReadyFibers = bundle->Next;
+		// WaitGroup and Fibtex expect this to be cleared when they resume
+		bundle->Next = nullptr;
+	}
+	return bundle;
 }
 
-bool TaskScheduler::GetNextHiPriTask(TaskBundle *nextTask, std::vector<TaskBundle> *taskBuffer) {
-	unsigned const currentThreadIndex = GetCurrentThreadIndex();
-	ThreadLocalStorage &tls = m_tls[currentThreadIndex];
+template <typename GetValue>
+void TaskScheduler::PushIncomingTasks(ThreadLocalStorage *tls, TaskPriority priority, size_t count, GetValue &&getValue) {
+	// The same as spilling, just to a queue that belongs to the thread
+	Spill(priority == TaskPriority::High ? &tls->IncomingHiPriTasks : &tls->IncomingLoPriTasks, 0, count, getValue);
+}
 
-	bool result = false;
+bool TaskScheduler::TakeIncomingTasks(ThreadLocalStorage *from, ThreadLocalStorage *to) {
+	bool taken = false;
+	for (TaskPriority const priority : { TaskPriority::High, TaskPriority::Normal }) {
+		bool const high = priority == TaskPriority::High;
+		OverflowQueue<TaskBundle> *const incoming = high ? &from->IncomingHiPriTasks : &from->IncomingLoPriTasks;
 
-	// Try to pop from our own queue
-	while (tls.HiPriTaskQueue.Pop(nextTask)) {
-		if (TaskIsReadyToExecute(nextTask)) {
-			result = true;
-			// Break to cleanup
-			goto cleanup; // NOLINT(cppcoreguidelines-avoid-goto)
+		// Cheap check first, so the common case doesn't touch the lock
+		if (incoming->Size.load(std::memory_order_relaxed) == 0) {
+			continue;
 		}
 
-		// It's a ReadyTask whose fiber hasn't switched away yet
-		// Add it to the buffer
-		taskBuffer->emplace_back(*nextTask);
+		// Take everything at once. The lock is only ever held by the threads handing over a share, or taking them
+		std::lock_guard<std::mutex> lock(incoming->Lock);
+		size_t const count = incoming->Items.size() - incoming->Head;
+		if (count == 0) {
+			// Someone else took them first
+			continue;
+		}
+		PushOrSpill(high ? &to->HiPriTaskQueue : &to->LoPriTaskQueue, high ? &m_hiPriOverflow : &m_loPriOverflow, count, [incoming](size_t i) {
+			return incoming->Items[incoming->Head + i];
+		});
+
+		// Keep the memory, so the next share doesn't have to allocate
+		incoming->Items.clear();
+		incoming->Head = 0;
+		incoming->Size.store(0, std::memory_order_relaxed);
+		taken = true;
 	}
 
-	// Force a scope so the `goto cleanup` above doesn't skip initialization
-	{
-		// Ours is empty, try to steal from the others'
-		const unsigned threadIndex = tls.HiPriLastSuccessfulSteal;
-		for (unsigned i = 0; i < m_numThreads; ++i) {
-			const unsigned threadIndexToStealFrom = (threadIndex + i) % m_numThreads;
-			if (threadIndexToStealFrom == currentThreadIndex) {
-				continue;
-			}
-			ThreadLocalStorage &otherTLS = m_tls[threadIndexToStealFrom];
+	return taken;
+}
 
-			while (otherTLS.HiPriTaskQueue.Steal(nextTask)) {
-				tls.HiPriLastSuccessfulSteal = threadIndexToStealFrom;
+template <typename T, size_t Capacity, typename GetValue>
+void TaskScheduler::PushOrSpill(WaitFreeQueue<T, Capacity> *queue, OverflowQueue<T> *overflow, size_t count, GetValue &&getValue) {
+	size_t const pushed = queue->PushBatch(count, getValue);
+	if (pushed == count) {
+		return;
+	}
 
-				if (TaskIsReadyToExecute(nextTask)) {
-					result = true;
-					// Break to cleanup
-					goto cleanup;
-				}
+	// Our queue is full. The rest go where any thread can get to them
+	Spill(overflow, pushed, count - pushed, getValue);
+}
 
-				// It's a ReadyTask whose fiber hasn't switched away yet
-				// Add it to the buffer
-				taskBuffer->emplace_back(*nextTask);
-			}
+template <typename T, typename GetValue>
+void TaskScheduler::Spill(OverflowQueue<T> *overflow, size_t first, size_t count, GetValue &&getValue) {
+	// Whoever wakes the other threads fences after this, so a thread that's about to sleep will see the new Size
+	std::lock_guard<std::mutex> lock(overflow->Lock);
+	for (size_t i = first; i < first + count; ++i) {
+		overflow->Items.push_back(getValue(i));
+	}
+	overflow->Size.store(overflow->Items.size() - overflow->Head, std::memory_order_relaxed);
+}
+
+template <typename T, size_t Capacity>
+bool TaskScheduler::TakeOverflow(OverflowQueue<T> *overflow, WaitFreeQueue<T, Capacity> *queue, T *value) {
+	// Cheap check first, so the common case doesn't touch the lock
+	if (overflow->Size.load(std::memory_order_relaxed) == 0) {
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(overflow->Lock);
+	if (overflow->Head == overflow->Items.size()) {
+		return false;
+	}
+	*value = overflow->Items[overflow->Head++];
+
+	// Take a batch, so we don't have to come back for each item
+	size_t const count = std::min(overflow->Items.size() - overflow->Head, kOverflowBatchSize - 1);
+	overflow->Head += queue->PushBatch(count, [overflow](size_t i) {
+		return overflow->Items[overflow->Head + i];
+	});
+
+	// Keep the memory, so the next spill doesn't have to allocate
+	if (overflow->Head == overflow->Items.size()) {
+		overflow->Items.clear();
+		overflow->Head = 0;
+	}
+	overflow->Size.store(overflow->Items.size() - overflow->Head, std::memory_order_relaxed);
+	return true;
+}
+
+bool TaskScheduler::StealIncomingTasks(ThreadLocalStorage *tls) {
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	for (unsigned i = 1; i < m_numThreads; ++i) {
+		if (TakeIncomingTasks(m_tls[(currentThreadIndex + i) % m_numThreads], tls)) {
+			return true;
 		}
 	}
 
-cleanup:
-	if (!taskBuffer->empty()) {
-		// Re-push all the tasks we found that we're ready to execute
-		// We (or another thread) will get them next round
-		do {
-			// Push them in the opposite order we popped them, to restore the order
-			tls.HiPriTaskQueue.Push(taskBuffer->back());
-			taskBuffer->pop_back();
-		} while (!taskBuffer->empty());
+	return false;
+}
 
-		// If we're using Sleep mode, we need to wake up the other threads
-		// They may have looked for tasks while we had them all in our temp buffer and thus not
-		// found anything and gone to sleep.
-		EmptyQueueBehavior const behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
-		if (behavior == EmptyQueueBehavior::Sleep) {
-			// Wake all the threads
-			ThreadSleepCV.notify_all();
+template <typename Queue>
+unsigned TaskScheduler::ChooseStealVictim(ThreadLocalStorage *tls, unsigned attempt, unsigned lastSuccessfulSteal, Queue ThreadLocalStorage::*queue) const {
+	// We work with offsets from the current thread, in [1, m_numThreads), so we never pick ourselves
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	unsigned const numOthers = m_numThreads - 1;
+
+	unsigned offset;
+	switch (m_victimSelection) {
+	case StealPolicy::Hierarchical:
+		// Closest first. Unless the closest ones had nothing last time, and we can't try them all at once
+		return m_stealOrder[currentThreadIndex * numOthers + (tls->StealWindowOffset + attempt) % numOthers];
+
+	case StealPolicy::Random:
+		offset = 1 + NextRandom(&tls->StealRandomState) % numOthers;
+		break;
+
+	case StealPolicy::PowerOfTwoChoices: {
+		unsigned const first = 1 + NextRandom(&tls->StealRandomState) % numOthers;
+		unsigned const second = 1 + NextRandom(&tls->StealRandomState) % numOthers;
+		size_t const firstSize = (m_tls[(currentThreadIndex + first) % m_numThreads]->*queue).SizeEstimate();
+		size_t const secondSize = (m_tls[(currentThreadIndex + second) % m_numThreads]->*queue).SizeEstimate();
+		offset = secondSize > firstSize ? second : first;
+		break;
+	}
+	case StealPolicy::Sequential:
+	default: {
+		// Start with the thread we last stole from. Or past the ones that had nothing since then
+		unsigned lastOffset = (lastSuccessfulSteal + m_numThreads - currentThreadIndex) % m_numThreads;
+		if (lastOffset == 0) {
+			lastOffset = 1;
 		}
+		offset = (lastOffset - 1 + tls->StealWindowOffset + attempt) % numOthers + 1;
+		break;
+	}
 	}
 
-	return result;
+	return (currentThreadIndex + offset) % m_numThreads;
 }
 
-bool TaskScheduler::GetNextLoPriTask(TaskBundle *nextTask) {
+WaitingFiberBundle *TaskScheduler::GetNextReadyFiber(bool steal) {
 	unsigned const currentThreadIndex = GetCurrentThreadIndex();
-	ThreadLocalStorage &tls = m_tls[currentThreadIndex];
+	ThreadLocalStorage &tls = *m_tls[currentThreadIndex];
+
+	WaitingFiberBundle *bundle;
 
 	// Try to pop from our own queue
-	if (tls.LoPriTaskQueue.Pop(nextTask)) {
+	if (tls.ReadyFibers.Pop(&bundle)) {
+		return bundle;
+	}
+	if (!steal) {
+		return nullptr;
+	}
+
+	// Ours is empty, try to steal from the others'
+	for (unsigned i = 0; i < m_stealAttempts; ++i) {
+		const unsigned threadIndexToStealFrom = ChooseStealVictim(&tls, i, tls.ReadyLastSuccessfulSteal, &ThreadLocalStorage::ReadyFibers);
+		ThreadLocalStorage &otherTLS = *m_tls[threadIndexToStealFrom];
+		if (otherTLS.ReadyFibers.Steal(&bundle)) {
+			tls.ReadyLastSuccessfulSteal = threadIndexToStealFrom;
+			tls.StealWindowOffset = 0;
+			return bundle;
+		}
+	}
+
+	// Then anything that didn't fit in the queues
+	if (TakeOverflow(&m_readyFiberOverflow, &tls.ReadyFibers, &bundle)) {
+		return bundle;
+	}
+
+	return nullptr;
+}
+
+bool TaskScheduler::GetNextHiPriTask(TaskBundle *nextTask, bool steal) {
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	ThreadLocalStorage &tls = *m_tls[currentThreadIndex];
+
+	// Try to pop from our own queue
+	if (tls.HiPriTaskQueue.Pop(nextTask)) {
 		return true;
 	}
+	if (!steal) {
+		return false;
+	}
 
 	// Ours is empty, try to steal from the others'
-	const unsigned threadIndex = tls.LoPriLastSuccessfulSteal;
-	for (unsigned i = 0; i < m_numThreads; ++i) {
-		const unsigned threadIndexToStealFrom = (threadIndex + i) % m_numThreads;
-		if (threadIndexToStealFrom == currentThreadIndex) {
-			continue;
+	for (unsigned i = 0; i < m_stealAttempts; ++i) {
+		const unsigned threadIndexToStealFrom = ChooseStealVictim(&tls, i, tls.HiPriLastSuccessfulSteal, &ThreadLocalStorage::HiPriTaskQueue);
+		ThreadLocalStorage &otherTLS = *m_tls[threadIndexToStealFrom];
+		if (otherTLS.HiPriTaskQueue.Steal(nextTask)) {
+			tls.HiPriLastSuccessfulSteal = threadIndexToStealFrom;
+			tls.StealWindowOffset = 0;
+			return true;
 		}
-		ThreadLocalStorage &otherTLS = m_tls[threadIndexToStealFrom];
+	}
+
+	// Then anything that didn't fit in the queues
+	return TakeOverflow(&m_hiPriOverflow, &tls.HiPriTaskQueue, nextTask);
+}
+
+bool TaskScheduler::GetNextLoPriTask(TaskBundle *nextTask, bool steal) {
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	ThreadLocalStorage &tls = *m_tls[currentThreadIndex];
+
+	// Try to pop from our own queue
+	if (tls.LoPriTaskQueue.Pop(nextTask)) {
+		return true;
+	}
+	if (!steal) {
+		return false;
+	}
+
+	// Ours is empty, try to steal from the others'
+	for (unsigned i = 0; i < m_stealAttempts; ++i) {
+		const unsigned threadIndexToStealFrom = ChooseStealVictim(&tls, i, tls.LoPriLastSuccessfulSteal, &ThreadLocalStorage::LoPriTaskQueue);
+		ThreadLocalStorage &otherTLS = *m_tls[threadIndexToStealFrom];
 		if (otherTLS.LoPriTaskQueue.Steal(nextTask)) {
 			tls.LoPriLastSuccessfulSteal = threadIndexToStealFrom;
+			tls.StealWindowOffset = 0;
 			return true;
 		}
 	}
 
-	return false;
+	// Then anything that didn't fit in the queues
+	return TakeOverflow(&m_loPriOverflow, &tls.LoPriTaskQueue, nextTask);
 }
 
-unsigned TaskScheduler::GetNextFreeFiberIndex() const {
+unsigned TaskScheduler::GetNextFreeFiberIndex(ThreadLocalStorage *tls, unsigned stackClass) {
+	// Fast path
+	// Take the most recently freed fiber on this thread. Its stack is likely still in cache
+	if (stackClass == 0 && tls->FiberCacheSize > 0) {
+		return tls->FiberCache[--tls->FiberCacheSize];
+	}
+
+	FiberStackClass *const requestedClass = &m_stackClasses[stackClass];
 	for (unsigned j = 0;; ++j) {
-		for (unsigned i = 0; i < m_fiberPoolSize; ++i) {
-			// Double lock
-			if (!m_freeFibers[i].load(std::memory_order_relaxed)) {
-				continue;
-			}
+		unsigned fiberIndex;
+		if (requestedClass->FreeFibers->Pop(&fiberIndex)) {
+			return fiberIndex;
+		}
 
-			if (!m_freeFibers[i].load(std::memory_order_acquire)) {
-				continue;
-			}
+		requestedClass->LastExhaustion.store(SteadyClockNs(), std::memory_order_relaxed);
+		if (GrowFiberPool(requestedClass)) {
+			continue;
+		}
 
-			bool expected = true;
-			if (std::atomic_compare_exchange_weak_explicit(&m_freeFibers[i], &expected, false, std::memory_order_release, std::memory_order_relaxed)) {
-				return i;
+		// A bigger stack works just as well. It's just more expensive
+		for (unsigned i = stackClass + 1; i < m_numStackClasses; ++i) {
+			if (m_stackClasses[i].FreeFibers->Pop(&fiberIndex)) {
+				return fiberIndex;
 			}
 		}
 
-		if (j > 10) {
+		if (j == 10) {
 			printf("No free fibers in the pool. Possible deadlock");
 		}
+		YieldThread();
+	}
+}
+
+void TaskScheduler::ReturnFiberToPool(ThreadLocalStorage *tls, unsigned fiberIndex) {
+	FiberStackClass *const stackClass = &m_stackClasses[GetFiberStackClass(fiberIndex)];
+	ReclaimFiberStack(stackClass, fiberIndex);
+
+	// Only keep fibers whose stacks are on our NUMA node. The rest go back to the shared pool, where a thread on their node can cache them
+	bool const remote = m_multipleNodes && GetFiberHomeNode(fiberIndex) != kInvalidIndex && GetFiberHomeNode(fiberIndex) != tls->NodeId;
+	if (stackClass != &m_stackClasses[0] || m_fiberCacheCapacity == 0 || remote) {
+		stackClass->FreeFibers->Push(fiberIndex);
+		return;
+	}
+
+	if (tls->FiberCacheSize == m_fiberCacheCapacity) {
+		// The cache is full. Give the older half of it to the shared pool, so other threads can use them
+		unsigned const spillCount = (tls->FiberCacheSize + 1) / 2;
+		stackClass->FreeFibers->PushMany(tls->FiberCache, spillCount);
+
+		tls->FiberCacheSize -= spillCount;
+		for (unsigned i = 0; i < tls->FiberCacheSize; ++i) {
+			tls->FiberCache[i] = tls->FiberCache[i + spillCount];
+		}
+	}
+
+	tls->FiberCache[tls->FiberCacheSize++] = fiberIndex;
+}
+
+bool TaskScheduler::GrowFiberPool(FiberStackClass *stackClass) {
+	std::lock_guard<std::mutex> lock(m_fiberPoolLock);
+
+	// Another thread may have grown the pool while we were waiting for the lock
+	if (!stackClass->FreeFibers->Empty()) {
+		return true;
+	}
+
+	unsigned const committedFibers = stackClass->CommittedFibers.load(std::memory_order_relaxed);
+	if (committedFibers >= stackClass->MaxFibers) {
+		return false;
+	}
+
+	unsigned const growthSize = std::min(m_fiberPoolGrowthSize, stackClass->MaxFibers - committedFibers);
+	std::vector<unsigned> newFiberIndices;
+	newFiberIndices.reserve(growthSize);
+	while (newFiberIndices.size() < growthSize) {
+		// Prefer the slots freed by trimming, so the fiber indices stay compact
+		unsigned fiberIndex;
+		if (!stackClass->TrimmedFibers.empty()) {
+			fiberIndex = stackClass->TrimmedFibers.back();
+			stackClass->TrimmedFibers.pop_back();
+		} else {
+			fiberIndex = stackClass->FirstFiberIndex + stackClass->SlotsUsed++;
+		}
+
+		CreatePoolFiber(stackClass, fiberIndex);
+		newFiberIndices.push_back(fiberIndex);
+	}
+	stackClass->FreeFibers->PushMany(newFiberIndices.data(), growthSize);
+
+	stackClass->CommittedFibers.store(committedFibers + growthSize, std::memory_order_relaxed);
+	stackClass->Stats.PeakCommittedFibers = std::max(stackClass->Stats.PeakCommittedFibers, committedFibers + growthSize);
+	++stackClass->Stats.GrowthCount;
+	stackClass->Stats.FibersGrown += growthSize;
+
+	return true;
+}
+
+bool TaskScheduler::IsEfficiencyThread(unsigned threadIndex) const {
+	// Unpinned threads could be on any core
+	return m_pinThreads && m_threadCpus[threadIndex].Capacity < m_maxThreadCapacity;
+}
+
+unsigned TaskScheduler::GetFiberHomeNode(unsigned fiberIndex) const {
+	// Only the fibers that start in the threads' caches have a home. See CreateThreadLocalStorage()
+	if (fiberIndex == 0 || fiberIndex > m_numThreads * m_fiberCacheCapacity) {
+		return kInvalidIndex;
+	}
+
+	return m_threadCpus[((fiberIndex - 1) / m_fiberCacheCapacity + 1) % m_numThreads].NodeId;
+}
+
+void TaskScheduler::CreateThreadLocalStorage(unsigned threadIndex) {
+	// Each thread's storage gets pages of its own, and the thread touches them first. So the OS puts them on
+	// the thread's NUMA node. The same goes for the task queues' arrays it allocates
+	size_t const size = RoundUpToMultiple(sizeof(ThreadLocalStorage), SystemPageSize());
+	void *const memory = AlignedAlloc(size, SystemPageSize());
+	unsigned const node = m_threadCpus[threadIndex].NodeId;
+	if (m_multipleNodes) {
+		MemoryBindToNode(memory, size, node);
+	}
+	auto *const tls = new (memory) ThreadLocalStorage(m_asymmetricQueueFences);
+
+	tls->NodeId = node;
+	tls->Efficiency = IsEfficiencyThread(threadIndex);
+	tls->HighPriorityOnly = threadIndex != 0 && threadIndex <= m_numReservedThreads;
+	// Give each thread a different random sequence, so they don't all pick the same threads to steal from
+	tls->StealRandomState = 2654435761U * (threadIndex + 1);
+	// Reserve room for the shares of batches other threads hand us, so AddTasks() doesn't allocate to spread a batch
+	// A share bigger than this still works. It just grows the vector the first time
+	if (m_spreadTasksThreshold != 0) {
+		tls->IncomingHiPriTasks.Items.reserve(kTaskQueueCapacity);
+		tls->IncomingLoPriTasks.Items.reserve(kTaskQueueCapacity);
+	}
+
+	// Start with our share of the pool cached. Their stacks were placed on our node. See GetFiberHomeNode()
+	// The shares are right after the main fiber. The workers' come first, since the main thread already has a fiber
+	// The cache is a stack, so push them in reverse. Then they're handed out in index order, like the shared pool
+	unsigned const share = (threadIndex + m_numThreads - 1) % m_numThreads;
+	unsigned const firstFiber = 1 + share * m_fiberCacheCapacity;
+	for (unsigned i = m_fiberCacheCapacity; i > 0; --i) {
+		tls->FiberCache[tls->FiberCacheSize++] = firstFiber + i - 1;
+	}
+
+	m_tls[threadIndex] = tls;
+	m_tlsCreated.fetch_add(1, std::memory_order_release);
+}
+
+unsigned TaskScheduler::GetFiberStackClass(unsigned fiberIndex) const {
+	// There are only ever a handful of classes
+	unsigned stackClass = 0;
+	while (stackClass + 1 < m_numStackClasses && fiberIndex >= m_stackClasses[stackClass + 1].FirstFiberIndex) {
+		++stackClass;
+	}
+
+	return stackClass;
+}
+
+void TaskScheduler::CreatePoolFiber(FiberStackClass *stackClass, unsigned fiberIndex) {
+	if (stackClass->StackArena != nullptr) {
+		char *const stack = GetArenaFiberStack(stackClass, fiberIndex);
+		// This only changes the protection. The OS won't back the pages until they're touched
+		if (MemoryCommit(stack, stackClass->StackSize)) {
+			// The Fiber constructor touches the top of the stack, so we have to set the node before it runs
+			unsigned const homeNode = m_multipleNodes ? GetFiberHomeNode(fiberIndex) : kInvalidIndex;
+			if (homeNode != kInvalidIndex) {
+				MemoryBindToNode(stack, stackClass->StackSize, homeNode);
+			}
+
+			m_fibers[fiberIndex] = Fiber(stack, stackClass->StackSize, FiberStartFunc, this);
+			return;
+		}
+	}
+
+	m_fibers[fiberIndex] = Fiber(stackClass->StackSize, FiberStartFunc, this);
+}
+
+void TaskScheduler::DestroyPoolFiber(FiberStackClass *stackClass, unsigned fiberIndex) {
+	// Swap in an empty fiber. If the fiber owns its stack, the temporary takes it with it when it's destroyed
+	m_fibers[fiberIndex] = Fiber();
+	m_deepFibers[fiberIndex] = false;
+
+	if (stackClass->StackArena != nullptr) {
+		// The stack stays committed, so CreatePoolFiber() can re-use it without a fault. Only the pages are released
+		MemoryDecommit(GetArenaFiberStack(stackClass, fiberIndex), stackClass->StackSize);
+	}
+}
+
+void TaskScheduler::ReclaimFiberStack(FiberStackClass const *stackClass, unsigned fiberIndex) {
+	// We only know it went deep if it waited while it was deep. See SwitchToFreeFiber()
+	// Anything else stays committed until the fiber is trimmed. Checking the stack itself would cost too much here
+	if (!m_deepFibers[fiberIndex]) {
+		return;
+	}
+	m_deepFibers[fiberIndex] = false;
+
+	// The fiber fell back to a heap allocated stack
+	if (m_fibers[fiberIndex].OwnsStack()) {
+		return;
+	}
+	MemoryDecommit(GetArenaFiberStack(stackClass, fiberIndex), stackClass->StackSize - m_fiberStackRetainSize);
+}
+
+void TaskScheduler::TrimFiberPool() {
+	if (m_fiberPoolTrimDelayNs == 0) {
+		return;
+	}
+
+	int64_t const now = SteadyClockNs();
+	for (unsigned i = 0; i < m_numStackClasses; ++i) {
+		FiberStackClass &stackClass = m_stackClasses[i];
+		if (stackClass.CommittedFibers.load(std::memory_order_relaxed) <= stackClass.MinFibers) {
+			continue;
+		}
+		if (now - stackClass.LastExhaustion.load(std::memory_order_relaxed) < m_fiberPoolTrimDelayNs) {
+			continue;
+		}
+
+		// Only one thread needs to do this. If someone else has the lock, they're either trimming or growing the pool
+		std::unique_lock<std::mutex> lock(m_fiberPoolLock, std::try_to_lock);
+		if (!lock.owns_lock()) {
+			return;
+		}
+
+		unsigned committedFibers = stackClass.CommittedFibers.load(std::memory_order_relaxed);
+		unsigned trimmedFibers = 0;
+		unsigned fiberIndex;
+		while (committedFibers > stackClass.MinFibers && stackClass.FreeFibers->Pop(&fiberIndex)) {
+			DestroyPoolFiber(&stackClass, fiberIndex);
+			stackClass.TrimmedFibers.push_back(fiberIndex);
+
+			--committedFibers;
+			++trimmedFibers;
+		}
+
+		if (trimmedFibers > 0) {
+			stackClass.CommittedFibers.store(committedFibers, std::memory_order_relaxed);
+			++stackClass.Stats.TrimCount;
+			stackClass.Stats.FibersTrimmed += trimmedFibers;
+		}
+	}
+}
+
+FiberPoolStats TaskScheduler::GetFiberPoolStats(unsigned stackClass) {
+	FTL_ASSERT("Unknown stack class", stackClass < m_numStackClasses);
+	std::lock_guard<std::mutex> lock(m_fiberPoolLock);
+
+	FiberPoolStats stats = m_stackClasses[stackClass].Stats;
+	stats.CommittedFibers = m_stackClasses[stackClass].CommittedFibers.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void TaskScheduler::ParkCurrentThread() {
+	unsigned const threadIndex = GetCurrentThreadIndex();
+	ThreadLocalStorage &tls = *m_tls[threadIndex];
+
+	// We're giving up looking for work, so make room for another thread to look
+	// The fence below orders this with the check in WakeIdleThreads()
+	if (tls.Spinning) {
+		tls.Spinning = false;
+		m_spinningThreads.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	// Tell the other threads we're going to sleep, so they wake us when they add work
+	// We may still be on the stack from an earlier round, if we found work before anyone woke us
+	if (!tls.InIdleStack.exchange(true, std::memory_order_relaxed)) {
+		LockFreeIndexStack *idleStack = m_idleThreads;
+		if (tls.HighPriorityOnly) {
+			idleStack = m_idleReservedThreads;
+		} else if (tls.Efficiency) {
+			idleStack = m_idleEfficiencyThreads;
+		}
+		idleStack->Push(threadIndex);
+	}
+
+	// Pairs with the fence in WakeIdleThreads()
+	// Either the thread adding work sees us on the idle stack, or we see its work here
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	// If the spinning threads are all busy, they'll find any work in the other threads' queues. We only need to check our own
+	// Otherwise, a thread that stopped spinning may have looked for us on the idle stack before we got there, so we check everything
+	bool const steal = m_maxSpinningThreads == 0 || m_spinningThreads.load(std::memory_order_relaxed) < m_maxSpinningThreads;
+	if (HasPendingWork(threadIndex, steal) || m_quit.load(std::memory_order_relaxed)) {
+		return;
+	}
+
+	// Work pinned to us doesn't go through the idle stack. WakeThread() leaves a token, so
+	// if it was readied after the check above, Park() returns immediately
+	m_parkedThreads.fetch_add(1, std::memory_order_relaxed);
+	tls.Parker.Park();
+	m_parkedThreads.fetch_sub(1, std::memory_order_relaxed);
+}
+
+bool TaskScheduler::HasPendingWork(unsigned threadIndex, bool steal) const {
+	ThreadLocalStorage const &tls = *m_tls[threadIndex];
+	if (tls.PinnedReadyFibers != nullptr || tls.PinnedReadyFibersHead.load(std::memory_order_relaxed) != nullptr) {
+		return true;
+	}
+	if (tls.IncomingHiPriTasks.Size.load(std::memory_order_relaxed) != 0 || tls.IncomingLoPriTasks.Size.load(std::memory_order_relaxed) != 0) {
+		return true;
+	}
+	// Reserved threads don't run low priority tasks, or take other threads' incoming batches. So those don't count
+	bool const lowPriority = !tls.HighPriorityOnly;
+	if (!steal) {
+		return !tls.ReadyFibers.Empty() || !tls.HiPriTaskQueue.Empty() || (lowPriority && !tls.LoPriTaskQueue.Empty());
+	}
+
+	if (m_readyFiberOverflow.Size.load(std::memory_order_relaxed) != 0 || m_hiPriOverflow.Size.load(std::memory_order_relaxed) != 0) {
+		return true;
+	}
+	if (lowPriority && m_loPriOverflow.Size.load(std::memory_order_relaxed) != 0) {
+		return true;
+	}
+
+	for (unsigned i = 0; i < m_numThreads; ++i) {
+		ThreadLocalStorage const &otherTLS = *m_tls[i];
+		if (!otherTLS.ReadyFibers.Empty() || !otherTLS.HiPriTaskQueue.Empty() || (lowPriority && !otherTLS.LoPriTaskQueue.Empty())) {
+			return true;
+		}
+		if (lowPriority && (otherTLS.IncomingHiPriTasks.Size.load(std::memory_order_relaxed) != 0 || otherTLS.IncomingLoPriTasks.Size.load(std::memory_order_relaxed) != 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void TaskScheduler::WakeIdleThreads(unsigned count, bool highPriority) {
+	// Pairs with the fence in ParkCurrentThread()
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	// Woken threads start looking for work in the other threads' queues
+	// Any beyond the spinning cap would just go back to sleep. The threads already spinning will find the work
+	if (m_maxSpinningThreads != 0) {
+		unsigned const spinning = m_spinningThreads.load(std::memory_order_relaxed);
+		if (spinning >= m_maxSpinningThreads) {
+			return;
+		}
+		count = std::min(count, m_maxSpinningThreads - spinning);
+	}
+
+	// Urgent work goes to the reserved threads first. Then the performance cores, since new work is more likely to be urgent than not
+	unsigned const currentThreadIndex = GetCurrentThreadIndex();
+	unsigned threadIndex;
+	while (count > 0 && ((highPriority && m_idleReservedThreads->Pop(&threadIndex)) || m_idleThreads->Pop(&threadIndex) || m_idleEfficiencyThreads->Pop(&threadIndex))) {
+		m_tls[threadIndex]->InIdleStack.store(false, std::memory_order_relaxed);
+
+		// We're awake, and will get to the work ourselves. Don't count it
+		if (threadIndex == currentThreadIndex) {
+			continue;
+		}
+
+		m_tls[threadIndex]->WakeRequestNs.store(SteadyClockNs(), std::memory_order_relaxed);
+		m_tls[threadIndex]->Parker.Unpark();
+		--count;
+	}
+}
+
+void TaskScheduler::WakeThread(unsigned threadIndex) {
+	m_tls[threadIndex]->WakeRequestNs.store(SteadyClockNs(), std::memory_order_relaxed);
+	m_tls[threadIndex]->Parker.Unpark();
+}
+
+bool TaskScheduler::ThreadsCanPark() const {
+	if (m_maxSpinningThreads != 0) {
+		return true;
+	}
+
+	EmptyQueueBehavior const behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
+	return behavior == EmptyQueueBehavior::Sleep || behavior == EmptyQueueBehavior::Adaptive;
+}
+
+bool TaskScheduler::StartSpinning(ThreadLocalStorage *tls) {
+	unsigned spinning = m_spinningThreads.load(std::memory_order_relaxed);
+	while (spinning < m_maxSpinningThreads) {
+		if (m_spinningThreads.compare_exchange_weak(spinning, spinning + 1, std::memory_order_relaxed)) {
+			tls->Spinning = true;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void TaskScheduler::StopSpinning(ThreadLocalStorage *tls) {
+	tls->Spinning = false;
+
+	// If we were the last thread looking for work, there's nobody left to notice any more work that shows up
+	// So wake another thread to take our place. This is how the number of awake threads ramps up under load
+	if (m_spinningThreads.fetch_sub(1, std::memory_order_relaxed) == 1) {
+		WakeIdleThreads(1, false);
+	}
+}
+
+void TaskScheduler::AdaptiveIdle(ThreadLocalStorage *tls) {
+	// We go through three phases, timed from the first time we failed to find work:
+	//     [0, budget)           Spin with FTL_PAUSE. Cheapest to wake from, but burns the core
+	//     [budget, 2 * budget)  Yield to the OS, so other processes can use the core
+	//     [2 * budget, ...)     Park, until someone adds work
+	// EndAdaptiveIdle() tunes the budget to the thread's recent idle periods
+	int64_t const now = SteadyClockNs();
+	if (tls->IdleStartNs == 0) {
+		tls->IdleStartNs = now;
+		tls->WokenAtNs = 0;
+		return;
+	}
+
+	int64_t const idleNs = now - tls->IdleStartNs;
+	if (idleNs < tls->AdaptiveSpinBudgetNs) {
+		for (unsigned i = 0; i < kAdaptiveSpinPauses; ++i) {
+			FTL_PAUSE();
+		}
+	} else if (idleNs < 2 * tls->AdaptiveSpinBudgetNs) {
+		YieldThread();
+	} else {
+		tls->WakeRequestNs.store(0, std::memory_order_relaxed);
+		ParkCurrentThread();
+		tls->WokenAtNs = tls->WakeRequestNs.load(std::memory_order_relaxed);
+	}
+}
+
+void TaskScheduler::EndAdaptiveIdle(ThreadLocalStorage *tls) {
+	int64_t const now = SteadyClockNs();
+
+	// If we were woken up, learn how long that took. Spinning for less than this is pointless,
+	// since work would have reached us faster if we'd stayed awake
+	if (tls->WokenAtNs != 0) {
+		int64_t const wakeLatency = std::min(std::max<int64_t>(now - tls->WokenAtNs, 0), kAdaptiveMaxWakeLatencyNs);
+		tls->AdaptiveWakeLatencyNs += (wakeLatency - tls->AdaptiveWakeLatencyNs) / 8;
+		tls->WokenAtNs = 0;
+	}
+	int64_t const wakeLatency = std::max(tls->AdaptiveWakeLatencyNs, kAdaptiveMinSpinNs);
+
+	// Long gaps are capped, so a single one can't drown out the recent short ones
+	int64_t const idleNs = std::min(now - tls->IdleStartNs, 8 * wakeLatency);
+	tls->AdaptiveIdleNs += (idleNs - tls->AdaptiveIdleNs) / 8;
+	tls->IdleStartNs = 0;
+
+	// If work usually shows up well after we could have slept and been woken, spinning is wasted
+	// Otherwise, spin for long enough to catch most gaps, but no longer than a couple of wake ups
+	if (tls->AdaptiveIdleNs > 4 * wakeLatency) {
+		tls->AdaptiveSpinBudgetNs = kAdaptiveMinSpinNs;
+	} else {
+		tls->AdaptiveSpinBudgetNs = std::min(std::max(2 * tls->AdaptiveIdleNs, kAdaptiveMinSpinNs), 2 * wakeLatency);
 	}
 }
 
@@ -671,23 +1709,28 @@ void TaskScheduler::CleanUpOldFiber() {
 	// Here, we call CleanUpOldFiber()
 	// QED
 
-	ThreadLocalStorage &tls = m_tls[GetCurrentThreadIndex()];
+	ThreadLocalStorage &tls = *m_tls[GetCurrentThreadIndex()];
 	switch (tls.OldFiberDestination) {
 	case FiberDestination::ToPool:
-		// In this specific implementation, the fiber pool is a flat array signaled by atomics
-		// So in order to "Push" the fiber to the fiber pool, we just set its corresponding atomic to true
-		m_freeFibers[tls.OldFiberIndex].store(true, std::memory_order_release);
+		// The old fiber has been switched away from, so it's now safe for any thread to use
+		ReturnFiberToPool(&tls, tls.OldFiberIndex);
 		tls.OldFiberDestination = FiberDestination::None;
 		tls.OldFiberIndex = kInvalidIndex;
 		break;
-	case FiberDestination::ToWaiting:
-		// The waiting fibers are stored directly in their counters
-		// They have an atomic<bool> that signals whether the waiting fiber can be consumed if it's ready
-		// We just have to set it to true
-		tls.OldFiberStoredFlag->store(true, std::memory_order_release);
+	case FiberDestination::ToWaiting: {
+		// The waiting fibers are stored directly in their WaitGroup / Fibtex
+		// Mark the fiber as switched away. If it was readied while we were switching, it's up to us to publish it
+		WaitingFiberBundle *bundle = tls.OldFiberBundle;
+		tls.OldFiberBundle = nullptr;
 		tls.OldFiberDestination = FiberDestination::None;
 		tls.OldFiberIndex = kInvalidIndex;
+
+		unsigned const previousState = bundle->State.fetch_or(WaitingFiberBundle::kSwitchedBit, std::memory_order_acq_rel);
+		if ((previousState & WaitingFiberBundle::kReadyBit) != 0) {
+			PublishReadyFiber(bundle);
+		}
 		break;
+	}
 	case FiberDestination::None:
 	default:
 		break;
@@ -695,54 +1738,49 @@ void TaskScheduler::CleanUpOldFiber() {
 }
 
 void TaskScheduler::AddReadyFiber(WaitingFiberBundle *bundle) {
+	// If the fiber has already switched away, we publish it. Otherwise, the thread switching away from it will
+	// do it in CleanUpOldFiber(). Either way, we can't touch the bundle after this, since the fiber may be resumed
+	unsigned const previousState = bundle->State.fetch_or(WaitingFiberBundle::kReadyBit, std::memory_order_acq_rel);
+	if ((previousState & WaitingFiberBundle::kSwitchedBit) != 0) {
+		PublishReadyFiber(bundle);
+	}
+}
+
+void TaskScheduler::PublishReadyFiber(WaitingFiberBundle *bundle) {
 	unsigned const pinnedThreadIndex = bundle->PinnedThreadIndex;
 
 	if (pinnedThreadIndex == kNoThreadPinning) {
-		ThreadLocalStorage *tls = &m_tls[GetCurrentThreadIndex()];
-
-		// Push a dummy task to the high priority queue
-		Task task{};
-		task.Function = ReadyFiberDummyTask;
-		task.ArgData = bundle;
-		TaskBundle taskBundle{};
-		taskBundle.TaskToExecute = task;
-		taskBundle.WG = nullptr;
-
-		tls->HiPriTaskQueue.Push(taskBundle);
-
-		// If we're using EmptyQueueBehavior::Sleep, the other threads could be sleeping
-		// Therefore, we need to kick a thread awake to ensure that the readied task is taken
-		const EmptyQueueBehavior behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
-		if (behavior == EmptyQueueBehavior::Sleep) {
-			ThreadSleepCV.notify_one();
+		ThreadLocalStorage *tls = m_tls[GetCurrentThreadIndex()];
+		PushOrSpill(&tls->ReadyFibers, &m_readyFiberOverflow, 1, [bundle](size_t) {
+			return bundle;
+		});
+
+		// If threads can park (see ThreadsCanPark()), the other threads could be sleeping
+		// Therefore, we need to kick a thread awake to ensure that the readied fiber is taken
+		if (ThreadsCanPark()) {
+			WakeIdleThreads(1, true);
 		}
 	} else {
-		ThreadLocalStorage *tls = &m_tls[pinnedThreadIndex];
+		ThreadLocalStorage *tls = m_tls[pinnedThreadIndex];
 
-		{
-			std::lock_guard<std::mutex> guard(tls->PinnedReadyFibersLock);
-			tls->PinnedReadyFibers.emplace_back(bundle);
-		}
+		PushPinnedReadyFiber(tls, bundle);
 
 		// If the Task is pinned, we add the Task to the pinned thread's PinnedReadyFibers queue
 		// Normally, this works fine; the other thread will pick it up next time it
 		// searches for a Task to run.
 		//
-		// However, if we're using EmptyQueueBehavior::Sleep, the other thread could be sleeping
-		// Therefore, we need to kick all the threads so that the pinned-to thread can take it
-		const EmptyQueueBehavior behavior = m_emptyQueueBehavior.load(std::memory_order_relaxed);
-		if (behavior == EmptyQueueBehavior::Sleep) {
+		// However, if threads can park (see ThreadsCanPark()), the other thread could be sleeping
+		// Therefore, we need to wake the pinned-to thread. Only that thread can take it
+		if (ThreadsCanPark()) {
 			if (GetCurrentThreadIndex() != pinnedThreadIndex) {
-				std::unique_lock<std::mutex> lock(ThreadSleepLock);
-				// Kick all threads
-				ThreadSleepCV.notify_all();
+				WakeThread(pinnedThreadIndex);
 			}
 		}
 	}
 }
 
 void TaskScheduler::InitWaitingFiberBundle(WaitingFiberBundle *bundle, bool pinToCurrentThread) {
-	ThreadLocalStorage &tls = m_tls[GetCurrentThreadIndex()];
+	ThreadLocalStorage &tls = *m_tls[GetCurrentThreadIndex()];
 	unsigned const currentFiberIndex = tls.CurrentFiberIndex;
 
 	unsigned pinnedThreadIndex;
@@ -753,23 +1791,34 @@ void TaskScheduler::InitWaitingFiberBundle(WaitingFiberBundle *bundle, bool pinT
 	}
 
 	bundle->FiberIndex = currentFiberIndex;
-	bundle->FiberIsSwitched.store(false);
+	bundle->State.store(0, std::memory_order_relaxed);
 	bundle->PinnedThreadIndex = pinnedThreadIndex;
 	bundle->Next = nullptr;
 }
 
-void TaskScheduler::SwitchToFreeFiber(std::atomic<bool> *fiberIsSwitched) {
-	ThreadLocalStorage &tls = m_tls[GetCurrentThreadIndex()];
+void TaskScheduler::SwitchToFreeFiber(WaitingFiberBundle *bundle) {
+	ThreadLocalStorage &tls = *m_tls[GetCurrentThreadIndex()];
 	unsigned const currentFiberIndex = tls.CurrentFiberIndex;
 
+	// Note if we're deep while we wait, so ReclaimFiberStack() knows to give the deep part back
+	// The address of a local is as good as the stack pointer
+	FiberStackClass const *const stackClass = &m_stackClasses[GetFiberStackClass(currentFiberIndex)];
+	if (stackClass->StackArena != nullptr && m_fiberStackRetainSize != 0 && m_fiberStackRetainSize < stackClass->StackSize) {
+		char const *const stack = GetArenaFiberStack(stackClass, currentFiberIndex);
+		auto const *const stackPointer = reinterpret_cast<char const *>(&currentFiberIndex);
+		if (stackPointer >= stack && stackPointer < stack + stackClass->StackSize - m_fiberStackRetainSize) {
+			m_deepFibers[currentFiberIndex] = true;
+		}
+	}
+
 	// Get a free fiber
-	unsigned const freeFiberIndex = GetNextFreeFiberIndex();
+	unsigned const freeFiberIndex = GetNextFreeFiberIndex(&tls);
 
 	// Fill in tls
 	tls.OldFiberIndex = currentFiberIndex;
 	tls.CurrentFiberIndex = freeFiberIndex;
 	tls.OldFiberDestination = FiberDestination::ToWaiting;
-	tls.OldFiberStoredFlag = fiberIsSwitched;
+	tls.OldFiberBundle = bundle;
 
 	if (m_callbacks.OnFiberDetached != nullptr) {
 		m_callbacks.OnFiberDetached(m_callbacks.Context, currentFiberIndex, true);
@@ -27,10 +27,19 @@
 namespace ftl {
 
 struct WaitingFiberBundle {
+	// Set once the fiber has been switched away from and "cleaned up". See @TaskScheduler::CleanUpOldFiber()
+	constexpr static unsigned kSwitchedBit = 1;
+	// Set once the fiber's wait condition is satisfied. See @TaskScheduler::AddReadyFiber()
+	constexpr static unsigned kReadyBit = 2;
+
 	// The fiber
 	unsigned FiberIndex;
-	// A flag used to signal if the fiber has been successfully switched out of and "cleaned up". See @TaskScheduler::CleanUpOldFiber()
-	std::atomic<bool> FiberIsSwitched;
+	/**
+	 * The handshake between the thread switching away from the fiber and the thread readying it
+	 * Each sets its bit. Whichever comes second publishes the fiber to a ready queue, so ready queues
+	 * never contain a fiber that is still running
+	 */
+	std::atomic<unsigned> State;
 	/**
 	 * The index of the thread this fiber is pinned to
 	 * If the fiber *isn't* pinned, this will equal std::numeric_limits<unsigned>::max()
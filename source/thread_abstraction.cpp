@@ -86,8 +86,8 @@ bool CreateThread(size_t stackSize, ThreadStartRoutine startRoutine, void *arg,
 	}
 
 	DWORD_PTR mask = 1ull << coreAffinity;
-	::SetThreadAffinityMask(returnThread, mask);
-	::ResumeThread(returnThread);
+	::SetThreadAffinityMask(returnThread->Handle, mask);
+	::ResumeThread(returnThread->Handle);
 
 	return true;
 }
@@ -118,6 +118,26 @@ bool SetCurrentThreadAffinity(size_t coreAffinity) {
 	return ret != 0;
 }
 
+bool SetCurrentThreadPriority(ThreadSchedulingPolicy policy, int priority) {
+	// Windows doesn't have scheduling policies. The closest we can get is the thread's priority level
+	int level;
+	if (policy != ThreadSchedulingPolicy::Normal) {
+		level = THREAD_PRIORITY_TIME_CRITICAL;
+	} else if (priority <= -10) {
+		level = THREAD_PRIORITY_HIGHEST;
+	} else if (priority < 0) {
+		level = THREAD_PRIORITY_ABOVE_NORMAL;
+	} else if (priority == 0) {
+		level = THREAD_PRIORITY_NORMAL;
+	} else if (priority < 10) {
+		level = THREAD_PRIORITY_BELOW_NORMAL;
+	} else {
+		level = THREAD_PRIORITY_LOWEST;
+	}
+
+	return ::SetThreadPriority(::GetCurrentThread(), level) != 0;
+}
+
 void SleepThread(int msDuration) {
 	::Sleep(msDuration);
 }
@@ -132,24 +152,76 @@ void YieldThread() {
 
 #	if defined(FTL_OS_LINUX)
 #		include <features.h>
+#		include <sys/resource.h>
+#		include <sys/syscall.h>
 #	endif
 #	include <pthread.h>
 #	include <sched.h>
 #	include <string.h>
 #	include <unistd.h>
 
+#	include <algorithm>
+
 namespace ftl {
 
-bool CreateThread(size_t stackSize, ThreadStartRoutine startRoutine, void *arg, const char *name, ThreadType *returnThread) {
-	(void)name;
+#	if defined(FTL_OS_APPLE)
+struct NamedThreadArgs {
+	ThreadStartRoutine StartRoutine;
+	void *Arg;
+	// MAXTHREADNAMESIZE, including the null terminator
+	char Name[64];
+};
+
+static void *NamedThreadStart(void *arg) {
+	auto *const namedArgs = static_cast<NamedThreadArgs *>(arg);
+	ThreadStartRoutine const startRoutine = namedArgs->StartRoutine;
+	void *const startArg = namedArgs->Arg;
+
+	pthread_setname_np(namedArgs->Name);
+	delete namedArgs;
 
+	return startRoutine(startArg);
+}
+#	endif
+
+static int StartNamedThread(pthread_attr_t const *threadAttr, ThreadStartRoutine startRoutine, void *arg, const char *threadName, ThreadType *returnThread) {
+#	if defined(FTL_OS_APPLE)
+	// macOS can only name the calling thread. So the new thread names itself, before it runs the start routine
+	auto *const namedArgs = new NamedThreadArgs{ startRoutine, arg, {} };
+	strncpy(namedArgs->Name, threadName, sizeof(namedArgs->Name) - 1);
+
+	int const ret = pthread_create(returnThread, threadAttr, NamedThreadStart, namedArgs);
+	if (ret != 0) {
+		delete namedArgs;
+	}
+	return ret;
+#	else
+	int const ret = pthread_create(returnThread, threadAttr, startRoutine, arg);
+
+#		if defined(FTL_OS_LINUX)
+	if (ret == 0) {
+		// Linux limits names to 16 bytes, including the null terminator. Longer names are rejected, rather than truncated
+		char name[16];
+		strncpy(name, threadName, sizeof(name) - 1);
+		name[sizeof(name) - 1] = '\0';
+		pthread_setname_np(*returnThread, name);
+	}
+#		else
+	(void)threadName;
+#		endif
+
+	return ret;
+#	endif
+}
+
+bool CreateThread(size_t stackSize, ThreadStartRoutine startRoutine, void *arg, const char *name, ThreadType *returnThread) {
 	pthread_attr_t threadAttr;
 	pthread_attr_init(&threadAttr);
 
 	// Set stack size
 	pthread_attr_setstacksize(&threadAttr, stackSize);
 
-	int success = pthread_create(returnThread, &threadAttr, startRoutine, arg);
+	int success = StartNamedThread(&threadAttr, startRoutine, arg, name, returnThread);
 
 	// Cleanup
 	pthread_attr_destroy(&threadAttr);
@@ -158,32 +230,38 @@ bool CreateThread(size_t stackSize, ThreadStartRoutine startRoutine, void *arg,
 }
 
 bool CreateThread(size_t stackSize, ThreadStartRoutine startRoutine, void *arg, const char *name, size_t coreAffinity, ThreadType *returnThread) {
-	(void)name;
-
 	pthread_attr_t threadAttr;
 	pthread_attr_init(&threadAttr);
 
 	// Set stack size
 	pthread_attr_setstacksize(&threadAttr, stackSize);
 
-	// TODO: OSX, MinGW, and musl Thread Affinity
-	//       musl can set the affinity after the thread has been started (using pthread_setaffinity_np() )
+	// TODO: OSX and MinGW Thread Affinity
 	//       To set the affinity at thread creation, glibc created the pthread_attr_setaffinity_np() extension
-#	if defined(FTL_OS_LINUX) && defined(__GLIBC__)
+	//       musl can only set the affinity after the thread has been started (using pthread_setaffinity_np() )
+#	if defined(FTL_OS_LINUX)
 	// Set core affinity
 	cpu_set_t cpuSet;
 	CPU_ZERO(&cpuSet);
 	CPU_SET(coreAffinity, &cpuSet);
+#		if defined(__GLIBC__)
 	pthread_attr_setaffinity_np(&threadAttr, sizeof(cpu_set_t), &cpuSet);
+#		endif
 #	else
 	(void)coreAffinity;
 #	endif
 
-	int success = pthread_create(returnThread, &threadAttr, startRoutine, arg);
+	int success = StartNamedThread(&threadAttr, startRoutine, arg, name, returnThread);
 
 	// Cleanup
 	pthread_attr_destroy(&threadAttr);
 
+#	if defined(FTL_OS_LINUX) && !defined(__GLIBC__)
+	if (success == 0) {
+		pthread_setaffinity_np(*returnThread, sizeof(cpu_set_t), &cpuSet);
+	}
+#	endif
+
 	return success == 0;
 }
 
@@ -220,6 +298,32 @@ bool SetCurrentThreadAffinity(size_t coreAffinity) {
 	return true;
 }
 
+bool SetCurrentThreadPriority(ThreadSchedulingPolicy policy, int priority) {
+	if (policy == ThreadSchedulingPolicy::Normal) {
+		sched_param param{};
+		param.sched_priority = 0;
+		if (pthread_setschedparam(pthread_self(), SCHED_OTHER, &param) != 0) {
+			return false;
+		}
+
+#	if defined(FTL_OS_LINUX)
+		// On Linux, nice values are per thread. setpriority() takes the thread id
+		return setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), priority) == 0;
+#	else
+		// Elsewhere, including macOS, nice values are per process. Changing it would change every thread, so we don't
+		// The thread keeps the process' nice value, which only counts as success if that's what was asked for
+		return priority == 0;
+#	endif
+	}
+
+	int const osPolicy = policy == ThreadSchedulingPolicy::RealtimeFifo ? SCHED_FIFO : SCHED_RR;
+	sched_param param{};
+	param.sched_priority = std::min(std::max(priority, sched_get_priority_min(osPolicy)), sched_get_priority_max(osPolicy));
+
+	// Fails with EPERM if we don't have the privilege. The thread keeps its old policy
+	return pthread_setschedparam(pthread_self(), osPolicy, &param) == 0;
+}
+
 void SleepThread(int msDuration) {
 	usleep(static_cast<unsigned>(msDuration) * 1000);
 }
@@ -95,11 +95,28 @@
 #include "ftl/wait_group.h"
 
 #include "ftl/assert.h"
+#include "ftl/config.h"
 #include "ftl/task_scheduler.h"
 #include "task_scheduler_internal.h"
 
 namespace ftl {
 
+/* The number of times to spin with FTL_PAUSE() on a release in progress, before yielding to the OS */
+constexpr static unsigned kReleaseSpinCount = 64;
+
+/**
+ * Waits a little, for an Add() that's releasing the waiters, or a waiter that holds the queue lock
+ * Both hold on for a handful of instructions, so we spin. We only yield if the other thread was preempted in the middle
+ */
+static void BackOff(unsigned *spinCount) {
+	if (*spinCount < kReleaseSpinCount) {
+		++*spinCount;
+		FTL_PAUSE();
+	} else {
+		YieldThread();
+	}
+}
+
 WaitGroup::WaitGroup(TaskScheduler *taskScheduler)
         : m_taskScheduler(taskScheduler),
           m_counter(0),
@@ -107,86 +124,78 @@ WaitGroup::WaitGroup(TaskScheduler *taskScheduler)
 }
 
 void WaitGroup::Add(int32_t delta) {
-	int32_t prev = m_counter.fetch_add(delta);
-	int32_t newValue = prev + delta;
-	FTL_ASSERT("Invalid WaitGroup usage - counter went negative", newValue >= 0);
+	// If this brings the counter to zero, mark it as releasing instead. Wait() doesn't return until we set it to zero
+	// Otherwise, a waiter could return, and destroy or reuse the WaitGroup while we're still taking the queue
+	int32_t prev = m_counter.load(std::memory_order_relaxed);
+	int32_t newValue;
+	unsigned spinCount = 0;
+	while (true) {
+		// The counter just reached zero, and that Add() is still releasing the waiters. We can't count on from zero until it's done
+		if (prev == kReleasing) {
+			BackOff(&spinCount);
+			prev = m_counter.load(std::memory_order_relaxed);
+			continue;
+		}
 
-	if (newValue > 0) {
-		return;
+		newValue = prev + delta;
+		FTL_ASSERT("Invalid WaitGroup usage - counter went negative", newValue >= 0);
+		if (m_counter.compare_exchange_weak(prev, newValue == 0 ? kReleasing : newValue)) {
+			break;
+		}
 	}
 
-	// This fiber reduced the value to zero.
-	// Wake all the waiting fibers
-
-	// Fast path
-	// There are no waiters
-	uintptr_t expected = 0;
-	if (std::atomic_compare_exchange_weak(&m_word, &expected, kIsQueueLockedBit)) {
-		// Release the lock and return
-		// We own the lock, so there's no need for a CAS
-		m_word.store(0);
+	if (newValue > 0) {
 		return;
 	}
 
-	// Slow path
+	// This fiber reduced the value to zero.
+	// Take all the waiting fibers. No new ones can join the queue while we're releasing
+	uintptr_t currentWordValue;
+	spinCount = 0;
 	while (true) {
-		uintptr_t currentWordValue = m_word.load();
+		currentWordValue = m_word.load();
 
-		// The fast path CAS spurriously failed
-		// Try again
-		if (currentWordValue == 0) {
-			if (std::atomic_compare_exchange_weak(&m_word, &currentWordValue, kIsQueueLockedBit)) {
-				// Release the lock and return
-				// We own the lock, so there's no need for a CAS
-				m_word.store(0);
-				return;
-			}
-			// Loop around and try again.
-			YieldThread();
+		// A waiter holds the queue lock. It will either see that we're releasing, or finish joining the queue first
+		if ((currentWordValue & kIsQueueLockedBit) == kIsQueueLockedBit) {
+			BackOff(&spinCount);
 			continue;
 		}
 
-		// There *are* waiters in the queue
-
-		// Acquire the queue lock
-		// We proceed only if the queue lock is not held and we succeed in acquiring the queue lock.
-		if ((currentWordValue & kIsQueueLockedBit) == kIsQueueLockedBit || !std::atomic_compare_exchange_weak(&m_word, &currentWordValue, currentWordValue | kIsQueueLockedBit)) {
-			YieldThread();
-			continue;
+		if (std::atomic_compare_exchange_weak(&m_word, &currentWordValue, static_cast<uintptr_t>(0))) {
+			break;
 		}
-
-		break;
 	}
 
-	uintptr_t currentWordValue = m_word.load();
-
-	// After we acquire the queue lock the queue must be non-empty. The queue must be non-empty since the fast path failed
-	// and we're the only one that can remove from the queue (since WaitGroup will hit zero only once for an Add() / Wait() cycle)
-	FTL_ASSERT("lock should be held", (currentWordValue & kIsQueueLockedBit) == kIsQueueLockedBit);
-	WaitingFiberBundle *queueHead = reinterpret_cast<WaitingFiberBundle *>(currentWordValue & ~kQueueHeadMask);
-	FTL_ASSERT("there should be a WaitingFiberBundle in the queue", queueHead != nullptr);
+	// This is the last time we touch `this`. Once the counter is zero, a waiter can return from Wait() and destroy the WaitGroup
+	TaskScheduler *const taskScheduler = m_taskScheduler;
+	m_counter.store(0);
 
 	// Resume all waiters
+	WaitingFiberBundle *queueHead = reinterpret_cast<WaitingFiberBundle *>(currentWordValue & ~kQueueHeadMask);
 	while (queueHead != nullptr) {
 		WaitingFiberBundle *next = queueHead->Next;
 
 		queueHead->Next = nullptr;
 		queueHead->QueueTail = nullptr;
-		m_taskScheduler->AddReadyFiber(queueHead);
+		taskScheduler->AddReadyFiber(queueHead);
 		queueHead = next;
 	}
-
-	// Reset the lock and the queue
-	m_word.store(0);
 }
 
 void WaitGroup::Wait(bool pinToCurrentThread) {
+	unsigned spinCount = 0;
 	while (true) {
 		// Fast path
 		// Counter is zero. No need to wait
-		if (m_counter.load(std::memory_order_relaxed) == 0) {
+		int32_t const counter = m_counter.load();
+		if (counter == 0) {
 			return;
 		}
+		// Add() is taking the waiters off the queue. It will be done in a moment
+		if (counter == kReleasing) {
+			BackOff(&spinCount);
+			continue;
+		}
 
 		uintptr_t currentWordValue = m_word.load();
 
@@ -197,19 +206,24 @@ void WaitGroup::Wait(bool pinToCurrentThread) {
 			continue;
 		}
 
-		break;
-	}
+		// We now own the lock
+		// Check the counter one last time
+		// It's possible Add() released the lock after it already woke up other threads
+		int32_t const lockedCounter = m_counter.load();
+		if (lockedCounter != 0 && lockedCounter != kReleasing) {
+			break;
+		}
 
-	// We now own the lock
-	// Check the counter one last time
-	// It's possible Add() released the lock after it already woke up other threads
-	if (m_counter.load() == 0) {
-		// Release the lock and return
+		// Release the lock
 		// We own the lock, so there's no need for a CAS
-		uintptr_t currentWordValue = m_word.load();
+		currentWordValue = m_word.load();
 		m_word.store(currentWordValue & ~kIsQueueLockedBit);
+		if (lockedCounter == 0) {
+			return;
+		}
 
-		return;
+		// Add() is waiting for us to let go of the queue. Then we wait for it to finish
+		BackOff(&spinCount);
 	}
 
 	uintptr_t currentWordValue = m_word.load();
@@ -243,11 +257,11 @@ void WaitGroup::Wait(bool pinToCurrentThread) {
 	}
 
 	// At this point everyone who acquires the queue lock will see `currentFiber` on the queue.
-	// `currentFiber.FiberIsSwitched` will still be false though, so any any other threads trying
-	// to resume this thread will wait for the current fiber to switch away below
+	// `currentFiber` won't be published to a ready queue until it has switched away below though, so
+	// any other threads trying to resume it will leave that to us
 
 	// Now switch
-	m_taskScheduler->SwitchToFreeFiber(&currentFiber.FiberIsSwitched);
+	m_taskScheduler->SwitchToFreeFiber(&currentFiber);
 
 	FTL_ASSERT("pointers should be nulled after de-queue", currentFiber.Next == nullptr);
 	FTL_ASSERT("pointers should be nulled after de-queue", currentFiber.QueueTail == nullptr);
@@ -0,0 +1,95 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/thread_abstraction.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+#include <chrono>
+
+constexpr static unsigned kAdaptiveThreadCount = 4;
+constexpr static unsigned kAdaptiveTaskCount = 64;
+
+static std::atomic<unsigned> g_adaptiveTasks;
+static std::atomic<unsigned> g_adaptiveTaskThreads;
+
+void AdaptiveTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	g_adaptiveTaskThreads.fetch_or(1U << taskScheduler->GetCurrentThreadIndex(), std::memory_order_relaxed);
+	g_adaptiveTasks.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool WaitForParkedThreads(ftl::TaskScheduler *taskScheduler, unsigned count) {
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (taskScheduler->GetParkedThreadCount() < count && std::chrono::steady_clock::now() < deadline) {
+		ftl::YieldThread();
+	}
+	return taskScheduler->GetParkedThreadCount() >= count;
+}
+
+/**
+ * Tests that EmptyQueueBehavior::Adaptive puts idle threads to sleep once their spin budget runs out, where Spin never does,
+ * and that the sleeping threads wake up when work is added
+ */
+TEST_CASE("Adaptive Idle", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kAdaptiveThreadCount;
+	options.Behavior = ftl::EmptyQueueBehavior::Spin;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	// The main thread is busy running this test, so only the workers can go to sleep
+	unsigned const workers = taskScheduler.GetThreadCount() - 1;
+
+	// Spinning threads never sleep. This is far longer than the largest adaptive spin budget
+	ftl::SleepThread(50);
+	REQUIRE(taskScheduler.GetParkedThreadCount() == 0);
+
+	// Once the budget runs out, they do
+	taskScheduler.SetEmptyQueueBehavior(ftl::EmptyQueueBehavior::Adaptive);
+	REQUIRE(WaitForParkedThreads(&taskScheduler, workers));
+
+	for (unsigned round = 0; round < 4; ++round) {
+		g_adaptiveTasks.store(0);
+		g_adaptiveTaskThreads.store(0);
+
+		ftl::Task tasks[kAdaptiveTaskCount];
+		for (auto &task : tasks) {
+			task = { AdaptiveTask, nullptr };
+		}
+		taskScheduler.AddTasks(kAdaptiveTaskCount, tasks, ftl::TaskPriority::Normal);
+
+		// Don't run any of the tasks ourselves. They only get done if adding them woke a worker
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (g_adaptiveTasks.load(std::memory_order_relaxed) < kAdaptiveTaskCount && std::chrono::steady_clock::now() < deadline) {
+			ftl::YieldThread();
+		}
+
+		REQUIRE(g_adaptiveTasks.load() == kAdaptiveTaskCount);
+		REQUIRE((g_adaptiveTaskThreads.load() & 1U) == 0);
+
+		// And the workers go back to sleep afterwards
+		REQUIRE(WaitForParkedThreads(&taskScheduler, workers));
+	}
+}
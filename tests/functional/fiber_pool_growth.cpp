@@ -0,0 +1,82 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/thread_abstraction.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+constexpr static unsigned kNestingDepth = 40;
+
+void NestedWait(ftl::TaskScheduler *taskScheduler, void *arg) {
+	auto const depth = reinterpret_cast<uintptr_t>(arg);
+	if (depth == 0) {
+		return;
+	}
+
+	// Each level waits on the next, so every level holds onto a fiber until the innermost task finishes
+	ftl::WaitGroup wg(taskScheduler);
+	taskScheduler->AddTask(ftl::Task{ NestedWait, reinterpret_cast<void *>(depth - 1) }, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+}
+
+/**
+ * Tests that the fiber pool grows when a burst of waits needs more fibers than FiberPoolSize,
+ * and that it shrinks back down once things are quiet again
+ */
+TEST_CASE("Fiber Pool Growth", "[functional]") {
+	constexpr unsigned kMinFibers = 8;
+	constexpr unsigned kMaxFibers = 128;
+
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 2;
+	options.FiberPoolSize = kMinFibers;
+	options.MaxFiberPoolSize = kMaxFibers;
+	options.FiberPoolGrowthSize = 4;
+	options.FiberPoolTrimDelayMs = 1;
+	options.Behavior = ftl::EmptyQueueBehavior::Yield;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTask(ftl::Task{ NestedWait, reinterpret_cast<void *>(static_cast<uintptr_t>(kNestingDepth)) }, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+
+	ftl::FiberPoolStats stats = taskScheduler.GetFiberPoolStats();
+	REQUIRE(stats.GrowthCount > 0);
+	REQUIRE(stats.FibersGrown == stats.GrowthCount * 4);
+	REQUIRE(stats.PeakCommittedFibers > kNestingDepth);
+	REQUIRE(stats.PeakCommittedFibers <= kMaxFibers);
+
+	// The worker thread trims the pool when it's idle
+	for (unsigned i = 0; i < 1000 && taskScheduler.GetFiberCount() > kMinFibers; ++i) {
+		ftl::SleepThread(5);
+	}
+
+	stats = taskScheduler.GetFiberPoolStats();
+	REQUIRE(stats.CommittedFibers == kMinFibers);
+	REQUIRE(stats.TrimCount > 0);
+	REQUIRE(stats.FibersTrimmed == stats.FibersGrown);
+}
@@ -0,0 +1,121 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+
+constexpr static unsigned kMediumStackClass = 1;
+constexpr static unsigned kLargeStackClass = 2;
+
+static std::atomic<unsigned> g_stackClassTasksDone;
+
+template <size_t kStackBytes>
+void UseStack(ftl::TaskScheduler *taskScheduler, void *arg) {
+	auto const waitForChildren = reinterpret_cast<uintptr_t>(arg) != 0;
+
+	// This would run off the end of a small stack and hit the guard page
+	volatile unsigned char buffer[kStackBytes];
+	for (size_t i = 0; i < kStackBytes; ++i) {
+		buffer[i] = static_cast<unsigned char>(i);
+	}
+
+	if (waitForChildren) {
+		// Suspend, so we get resumed (possibly on another thread). The fiber has to keep its big stack
+		ftl::WaitGroup wg(taskScheduler);
+		for (unsigned i = 0; i < 8; ++i) {
+			taskScheduler->AddTask(ftl::Task{ UseStack<1024>, nullptr }, ftl::TaskPriority::Normal, &wg);
+		}
+		wg.Wait();
+	}
+
+	bool intact = true;
+	for (size_t i = 0; i < kStackBytes; ++i) {
+		intact = intact && buffer[i] == static_cast<unsigned char>(i);
+	}
+	if (intact) {
+		g_stackClassTasksDone.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+/**
+ * Tests that tasks run on fibers from the stack class they ask for
+ */
+TEST_CASE("Fiber Stack Classes", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	options.FiberPoolSize = 64;
+	options.FiberStackSize = 32 * 1024;
+	options.ExtraFiberStackClasses.resize(2);
+	options.ExtraFiberStackClasses[0].StackSize = 256 * 1024;
+	options.ExtraFiberStackClasses[0].PoolSize = 8;
+	options.ExtraFiberStackClasses[0].MaxPoolSize = 32;
+	options.ExtraFiberStackClasses[1].StackSize = 1024 * 1024;
+	options.ExtraFiberStackClasses[1].PoolSize = 0;
+	options.ExtraFiberStackClasses[1].MaxPoolSize = 4;
+	REQUIRE(taskScheduler.Init(options) == 0);
+	REQUIRE(taskScheduler.GetFiberStackClassCount() == 3);
+
+	g_stackClassTasksDone.store(0);
+
+	constexpr unsigned kTasksPerClass = 32;
+	ftl::WaitGroup wg(&taskScheduler);
+	for (unsigned i = 0; i < kTasksPerClass; ++i) {
+		taskScheduler.AddTask(ftl::Task{ UseStack<8 * 1024>, nullptr }, ftl::TaskPriority::Normal, &wg);
+		taskScheduler.AddTask(ftl::Task{ UseStack<128 * 1024>, reinterpret_cast<void *>(1) }, ftl::TaskPriority::Normal, &wg, kMediumStackClass);
+		taskScheduler.AddTask(ftl::Task{ UseStack<512 * 1024>, nullptr }, ftl::TaskPriority::High, &wg, kLargeStackClass);
+	}
+	wg.Wait();
+
+	// Every medium task also ran 8 small children
+	REQUIRE(g_stackClassTasksDone.load() == kTasksPerClass * (3 + 8));
+
+	// The large class starts empty, so it must have grown to run the large tasks
+	ftl::FiberPoolStats const largeStats = taskScheduler.GetFiberPoolStats(kLargeStackClass);
+	REQUIRE(largeStats.GrowthCount > 0);
+	REQUIRE(largeStats.PeakCommittedFibers <= 4);
+}
+
+TEST_CASE("Fiber Stack Classes Must Grow", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.FiberPoolSize = 16;
+	options.FiberStackSize = 64 * 1024;
+	options.ExtraFiberStackClasses.resize(1);
+	options.ExtraFiberStackClasses[0].StackSize = 32 * 1024;
+	options.ExtraFiberStackClasses[0].PoolSize = 4;
+	REQUIRE(taskScheduler.Init(options) == -70);
+}
+
+TEST_CASE("Fiber Pool Must Not Start Empty", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	// Class 0 can grow, but its first slot belongs to the main thread fiber
+	options.FiberPoolSize = 0;
+	options.MaxFiberPoolSize = 64;
+	REQUIRE(taskScheduler.Init(options) == -70);
+}
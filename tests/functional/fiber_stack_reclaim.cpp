@@ -0,0 +1,181 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+
+#if defined(FTL_OS_LINUX)
+#	include "ftl/alloc.h"
+
+#	include <sys/mman.h>
+
+#	include <vector>
+#endif
+
+constexpr static size_t kDeepStackBytes = 128 * 1024;
+constexpr static unsigned kReclaimNestingDepth = 4;
+
+static std::atomic<unsigned> g_corruptStacks;
+
+void DeepStackTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	auto const depth = reinterpret_cast<uintptr_t>(arg);
+
+	// Dirty a big chunk of the stack, well past the retained part
+	volatile unsigned char buffer[kDeepStackBytes];
+	for (size_t i = 0; i < kDeepStackBytes; ++i) {
+		buffer[i] = static_cast<unsigned char>(i + depth);
+	}
+
+	if (depth > 0) {
+		// While we wait, other fibers go back to the pool and have their stacks reclaimed. Ours must be left alone
+		ftl::WaitGroup wg(taskScheduler);
+		for (unsigned i = 0; i < 4; ++i) {
+			taskScheduler->AddTask(ftl::Task{ DeepStackTask, reinterpret_cast<void *>(depth - 1) }, ftl::TaskPriority::Normal, &wg);
+		}
+		wg.Wait();
+	}
+
+	for (size_t i = 0; i < kDeepStackBytes; ++i) {
+		if (buffer[i] != static_cast<unsigned char>(i + depth)) {
+			g_corruptStacks.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+}
+
+/**
+ * Tests that giving the deep part of pooled fiber stacks back to the OS doesn't touch fibers that are still in use
+ */
+TEST_CASE("Fiber Stack Reclaim", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.FiberPoolSize = 400;
+	options.FiberStackSize = 256 * 1024;
+	options.FiberStackRetainSize = 16 * 1024;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_corruptStacks.store(0);
+
+	for (unsigned i = 0; i < 8; ++i) {
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTask(ftl::Task{ DeepStackTask, reinterpret_cast<void *>(static_cast<uintptr_t>(kReclaimNestingDepth)) }, ftl::TaskPriority::Normal, &wg);
+		wg.Wait();
+	}
+
+	REQUIRE(g_corruptStacks.load() == 0);
+}
+
+#if defined(FTL_OS_LINUX)
+
+constexpr static unsigned kRecursionDepth = 6;
+constexpr static size_t kRecursionFrameBytes = 24 * 1024;
+constexpr static size_t kCheckedStackBytes = 64 * 1024;
+
+struct DeepRecursionArg {
+	unsigned char Fill;
+	char const *Deepest;
+	size_t ResidentWhileDeep;
+	unsigned Checksum;
+};
+
+static size_t ResidentPages(char const *begin, size_t bytes) {
+	size_t const pageSize = ftl::SystemPageSize();
+	uintptr_t const first = (reinterpret_cast<uintptr_t>(begin) + pageSize - 1) & ~(pageSize - 1);
+	std::vector<unsigned char> pages(bytes / pageSize);
+	if (mincore(reinterpret_cast<void *>(first), pages.size() * pageSize, pages.data()) != 0) {
+		return ~size_t(0);
+	}
+
+	size_t resident = 0;
+	for (unsigned char const page : pages) {
+		resident += page & 1;
+	}
+	return resident;
+}
+
+void EmptyTask(ftl::TaskScheduler * /*taskScheduler*/, void * /*arg*/) {
+}
+
+static unsigned Recurse(ftl::TaskScheduler *taskScheduler, DeepRecursionArg *arg, unsigned depth) {
+	volatile unsigned char frame[kRecursionFrameBytes];
+	for (size_t i = 0; i < kRecursionFrameBytes; ++i) {
+		frame[i] = arg->Fill;
+	}
+
+	unsigned checksum = 0;
+	if (depth > 0) {
+		checksum = Recurse(taskScheduler, arg, depth - 1);
+	} else {
+		arg->Deepest = const_cast<char const *>(reinterpret_cast<volatile char const *>(frame));
+		arg->ResidentWhileDeep = ResidentPages(arg->Deepest, kCheckedStackBytes);
+
+		// Waiting while deep is what tells the scheduler to reclaim the stack
+		ftl::WaitGroup wg(taskScheduler);
+		taskScheduler->AddTask(ftl::Task{ EmptyTask, nullptr }, ftl::TaskPriority::Normal, &wg);
+		wg.Wait();
+	}
+
+	// Reading the frame back keeps it alive until the recursion unwinds
+	return checksum + frame[kRecursionFrameBytes - 1];
+}
+
+void DeepRecursionTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	auto *deepArg = static_cast<DeepRecursionArg *>(arg);
+	deepArg->Checksum = Recurse(taskScheduler, deepArg, kRecursionDepth);
+}
+
+/**
+ * Tests that the pages of a deep recursion are given back to the OS when the fiber goes back to the pool, if it waited
+ * while it was deep. Whether or not the deep frames left data behind
+ */
+TEST_CASE("Fiber Stack Reclaim Resident Pages", "[functional]") {
+	unsigned char const fill = GENERATE(static_cast<unsigned char>(0x5A), static_cast<unsigned char>(0));
+
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	// One thread, so the fiber that ran the task is the one that goes back to the pool when we resume
+	options.ThreadPoolSize = 1;
+	options.FiberPoolSize = 16;
+	options.FiberStackSize = 256 * 1024;
+	options.FiberStackRetainSize = 16 * 1024;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	DeepRecursionArg arg{ fill, nullptr, 0, 0 };
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTask(ftl::Task{ DeepRecursionTask, &arg }, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+	REQUIRE(arg.Checksum == (kRecursionDepth + 1) * fill);
+
+	// The deepest frames were well past the retained part. They were resident while the task used them, and aren't any more
+	size_t const pageSize = ftl::SystemPageSize();
+	REQUIRE(arg.Deepest != nullptr);
+	REQUIRE(arg.ResidentWhileDeep >= kCheckedStackBytes / pageSize - 1);
+	REQUIRE(ResidentPages(arg.Deepest, kCheckedStackBytes) == 0);
+}
+
+#endif
@@ -73,3 +73,29 @@ TEST_CASE("Producer Consumer", "[functional]") {
 	// Test to see that all tasks finished
 	REQUIRE(kNumProducerTasks * kNumConsumerTasks == globalCounter.load());
 }
+
+/**
+ * The same, with the queues using asymmetric fences, where the OS supports them
+ */
+TEST_CASE("Producer Consumer Asymmetric Fences", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	options.AsymmetricQueueFences = true;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	std::atomic<unsigned> globalCounter(0U);
+	FTL_VALGRIND_HG_DISABLE_CHECKING(&globalCounter, sizeof(globalCounter));
+
+	std::array<ftl::Task, kNumProducerTasks> tasks{};
+	for (auto &&task : tasks) {
+		task = { Producer, &globalCounter };
+	}
+
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(kNumProducerTasks, tasks.data(), ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+
+	// Test to see that all tasks finished
+	REQUIRE(kNumProducerTasks * kNumConsumerTasks == globalCounter.load());
+}
@@ -0,0 +1,99 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <vector>
+
+// Well past the capacity of a thread's task queues and ready fiber queue
+constexpr static unsigned kOverflowTaskCount = 5000;
+constexpr static unsigned kOverflowWaiterCount = 400;
+
+static std::atomic<unsigned> g_overflowTasksRun;
+static std::atomic<unsigned> g_overflowWaitersArrived;
+
+void OverflowLeafTask(ftl::TaskScheduler * /*taskScheduler*/, void * /*arg*/) {
+	g_overflowTasksRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+void OverflowWaiterTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	ftl::WaitGroup *gate = static_cast<ftl::WaitGroup *>(arg);
+
+	// The last one to arrive opens the gate. That makes its thread resume all the others at once
+	if (g_overflowWaitersArrived.fetch_add(1) + 1 == kOverflowWaiterCount) {
+		gate->Done();
+	} else {
+		gate->Wait();
+	}
+	g_overflowTasksRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Tests that work that doesn't fit in the fixed size queues spills over, and still gets run
+ */
+TEST_CASE("Queue Overflow", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	options.FiberPoolSize = kOverflowWaiterCount + 16;
+	// Don't spread, so everything lands on the main thread's queues
+	options.SpreadTasksThreshold = 0;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	// Tasks that don't fit in the queues
+	for (unsigned round = 0; round < 4; ++round) {
+		g_overflowTasksRun.store(0);
+		std::vector<ftl::Task> tasks(kOverflowTaskCount, { OverflowLeafTask, nullptr });
+
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTasks(kOverflowTaskCount, tasks.data(), ftl::TaskPriority::Normal, &wg);
+		taskScheduler.AddTasks(kOverflowTaskCount, tasks.data(), ftl::TaskPriority::High, &wg);
+		for (unsigned i = 0; i < kOverflowTaskCount; ++i) {
+			taskScheduler.AddTask(tasks[i], i % 2 == 0 ? ftl::TaskPriority::Normal : ftl::TaskPriority::High, &wg);
+		}
+		wg.Wait();
+
+		REQUIRE(g_overflowTasksRun.load() == 3 * kOverflowTaskCount);
+	}
+
+	// Ready fibers that don't fit in the queue
+	g_overflowTasksRun.store(0);
+	g_overflowWaitersArrived.store(0);
+
+	ftl::WaitGroup gate(&taskScheduler);
+	gate.Add(1);
+	std::vector<ftl::Task> waiters(kOverflowWaiterCount, { OverflowWaiterTask, &gate });
+
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(kOverflowWaiterCount, waiters.data(), ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+
+	REQUIRE(g_overflowTasksRun.load() == kOverflowWaiterCount);
+}
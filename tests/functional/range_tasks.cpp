@@ -0,0 +1,122 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <memory>
+
+constexpr static size_t kRangeTaskSize = 1000000;
+constexpr static size_t kNestedRangeSize = 1000;
+
+struct RangeHits {
+	std::unique_ptr<std::atomic<uint8_t>[]> Hits;
+	std::atomic<size_t> Chunks;
+	std::atomic<size_t> LargestChunk;
+	size_t Grain;
+};
+
+void CountRangeHits(ftl::TaskScheduler * /*taskScheduler*/, void *arg, size_t begin, size_t end) {
+	RangeHits *hits = static_cast<RangeHits *>(arg);
+	for (size_t i = begin; i < end; ++i) {
+		hits->Hits[i].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	hits->Chunks.fetch_add(1, std::memory_order_relaxed);
+	size_t largest = hits->LargestChunk.load(std::memory_order_relaxed);
+	while (end - begin > largest && !hits->LargestChunk.compare_exchange_weak(largest, end - begin, std::memory_order_relaxed)) {
+	}
+}
+
+// Each index of the outer range runs a whole range of its own
+void NestedRange(ftl::TaskScheduler *taskScheduler, void *arg, size_t begin, size_t end) {
+	auto *counter = static_cast<std::atomic<size_t> *>(arg);
+	for (size_t i = begin; i < end; ++i) {
+		ftl::RangeTask inner = {
+			[](ftl::TaskScheduler * /*taskScheduler*/, void *innerArg, size_t innerBegin, size_t innerEnd) {
+				static_cast<std::atomic<size_t> *>(innerArg)->fetch_add(innerEnd - innerBegin, std::memory_order_relaxed);
+			},
+			counter, 0, kNestedRangeSize, 0
+		};
+
+		ftl::WaitGroup wg(taskScheduler);
+		taskScheduler->AddRangeTask(&inner, ftl::TaskPriority::Normal, &wg);
+		wg.Wait();
+	}
+}
+
+/**
+ * Tests that range tasks run every index exactly once, however they get split between threads
+ */
+TEST_CASE("Range Tasks", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = GENERATE(1U, 4U);
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	for (size_t const grain : { size_t(0), size_t(1000), size_t(7) }) {
+		for (ftl::TaskPriority const priority : { ftl::TaskPriority::Normal, ftl::TaskPriority::High }) {
+			RangeHits hits;
+			hits.Hits.reset(new std::atomic<uint8_t>[kRangeTaskSize]);
+			for (size_t i = 0; i < kRangeTaskSize; ++i) {
+				hits.Hits[i].store(0, std::memory_order_relaxed);
+			}
+			hits.Chunks.store(0);
+			hits.LargestChunk.store(0);
+
+			ftl::RangeTask task = { CountRangeHits, &hits, 0, kRangeTaskSize, grain };
+			ftl::WaitGroup wg(&taskScheduler);
+			taskScheduler.AddRangeTask(&task, priority, &wg);
+			wg.Wait();
+
+			// Every index runs exactly once, in chunks no bigger than the grain
+			bool allOnce = true;
+			for (size_t i = 0; i < kRangeTaskSize; ++i) {
+				allOnce &= hits.Hits[i].load(std::memory_order_relaxed) == 1;
+			}
+			REQUIRE(allOnce);
+			if (grain != 0) {
+				REQUIRE(hits.LargestChunk.load() <= grain);
+			}
+		}
+	}
+
+	// Range tasks inside range tasks
+	std::atomic<size_t> counter(0);
+	ftl::RangeTask outer = { NestedRange, &counter, 0, 64, 1 };
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddRangeTask(&outer, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+	REQUIRE(counter.load() == 64 * kNestedRangeSize);
+
+	// An empty range doesn't queue anything
+	ftl::RangeTask empty = { CountRangeHits, nullptr, 10, 10, 0 };
+	taskScheduler.AddRangeTask(&empty, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+}
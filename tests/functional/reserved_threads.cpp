@@ -0,0 +1,181 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+constexpr static unsigned kReservedThreadCount = 4;
+constexpr static unsigned kReservedFanOut = 64;
+
+// Bit i is set if thread i ran a task of that priority
+static std::atomic<unsigned> g_normalTaskThreads;
+static std::atomic<unsigned> g_highTaskThreads;
+static std::atomic<unsigned> g_reservedTasksRun;
+static std::atomic<bool> g_reservedBranchRan;
+
+void ReservedNormalLeafTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	g_normalTaskThreads.fetch_or(1U << taskScheduler->GetCurrentThreadIndex(), std::memory_order_relaxed);
+	g_reservedTasksRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ReservedHighLeafTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	g_highTaskThreads.fetch_or(1U << taskScheduler->GetCurrentThreadIndex(), std::memory_order_relaxed);
+	g_reservedTasksRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+void ReservedBranchTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	unsigned const threadIndex = taskScheduler->GetCurrentThreadIndex();
+	g_highTaskThreads.fetch_or(1U << threadIndex, std::memory_order_relaxed);
+
+	// Threads 1 and 2 are reserved. Hold the other threads here until a reserved thread has run a branch, so the
+	// remaining branches can only go to the reserved threads. Give up eventually, so a broken scheduler fails rather
+	// than hangs
+	if (threadIndex == 1 || threadIndex == 2) {
+		g_reservedBranchRan.store(true);
+	} else {
+		auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+		while (!g_reservedBranchRan.load() && std::chrono::steady_clock::now() < deadline) {
+			ftl::YieldThread();
+		}
+	}
+
+	// Whichever thread this runs on, including a reserved one, the normal priority tasks it adds must go to the others
+	ftl::Task tasks[kReservedFanOut];
+	for (unsigned i = 0; i < kReservedFanOut; ++i) {
+		tasks[i] = { i % 2 == 0 ? ReservedNormalLeafTask : ReservedHighLeafTask, nullptr };
+	}
+
+	ftl::WaitGroup wg(taskScheduler);
+	for (unsigned i = 0; i < kReservedFanOut; ++i) {
+		taskScheduler->AddTask(tasks[i], i % 2 == 0 ? ftl::TaskPriority::Normal : ftl::TaskPriority::High, &wg);
+	}
+	// A big batch is spread between the threads. None of it may land on a reserved thread
+	unsigned const spreadCount = *static_cast<unsigned *>(arg);
+	std::vector<ftl::Task> spreadTasks(spreadCount, { ReservedNormalLeafTask, nullptr });
+	taskScheduler->AddTasks(spreadCount, spreadTasks.data(), ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+}
+
+/**
+ * Tests that the threads reserved for high priority work never run normal priority tasks, and that the normal priority
+ * tasks they add still get run
+ */
+TEST_CASE("Reserved High Priority Threads", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kReservedThreadCount;
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	options.ReservedHighPriorityThreads = 2;
+	options.SpreadTasksThreshold = 16;
+	// With one attempt, thread 2 isn't in any unreserved thread's steal window. Normal tasks left in its queue would never run
+	options.MaxStealAttempts = GENERATE(0U, 1U);
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_normalTaskThreads.store(0);
+	g_highTaskThreads.store(0);
+	g_reservedTasksRun.store(0);
+	g_reservedBranchRan.store(false);
+
+	unsigned spreadCount = 32;
+	for (unsigned i = 0; i < 16; ++i) {
+		ftl::Task tasks[kReservedFanOut];
+		for (auto &task : tasks) {
+			task = { ReservedBranchTask, &spreadCount };
+		}
+
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTasks(kReservedFanOut, tasks, ftl::TaskPriority::High, &wg);
+		wg.Wait();
+	}
+
+	REQUIRE(g_reservedTasksRun.load() == 16 * kReservedFanOut * (kReservedFanOut + spreadCount));
+
+	// The reserved threads ran some of the branches, so they added normal priority tasks too
+	REQUIRE((g_normalTaskThreads.load() & 0x6U) == 0);
+	REQUIRE((g_highTaskThreads.load() & 0x6U) != 0);
+}
+
+static std::atomic<unsigned> g_busyTasksStarted;
+static std::atomic<unsigned> g_busyTasksRunning;
+static std::atomic<bool> g_urgentTaskRan;
+static std::atomic<unsigned> g_urgentTaskThread;
+static std::atomic<unsigned> g_busyTasksWhenUrgentRan;
+
+void ReservedUrgentTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	g_urgentTaskThread.store(taskScheduler->GetCurrentThreadIndex());
+	g_busyTasksWhenUrgentRan.store(g_busyTasksRunning.load());
+	g_urgentTaskRan.store(true);
+}
+
+void ReservedBusyTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	// The last unreserved thread to get busy adds the urgent task. It can only run on the reserved thread
+	unsigned const unreservedThreads = *static_cast<unsigned *>(arg);
+	g_busyTasksRunning.fetch_add(1);
+	if (g_busyTasksStarted.fetch_add(1) + 1 == unreservedThreads) {
+		taskScheduler->AddTask({ ReservedUrgentTask, nullptr }, ftl::TaskPriority::High);
+	}
+
+	// Hold on to the thread until the urgent task has run. Give up eventually, so a broken scheduler fails rather than hangs
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (!g_urgentTaskRan.load() && std::chrono::steady_clock::now() < deadline) {
+		ftl::YieldThread();
+	}
+	g_busyTasksRunning.fetch_sub(1);
+}
+
+/**
+ * Tests that high priority work starts right away on a reserved thread, even when every other thread is stuck in a long task
+ */
+TEST_CASE("Reserved Threads Run Urgent Work", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kReservedThreadCount;
+	options.ReservedHighPriorityThreads = 1;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_busyTasksStarted.store(0);
+	g_busyTasksRunning.store(0);
+	g_urgentTaskRan.store(false);
+
+	// One for every thread. If the reserved thread took one too, nobody would be left for the urgent task
+	unsigned unreservedThreads = kReservedThreadCount - 1;
+	ftl::Task tasks[kReservedThreadCount];
+	for (auto &task : tasks) {
+		task = { ReservedBusyTask, &unreservedThreads };
+	}
+
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(kReservedThreadCount, tasks, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+
+	REQUIRE(g_urgentTaskRan.load());
+	REQUIRE(g_urgentTaskThread.load() == 1);
+	REQUIRE(g_busyTasksWhenUrgentRan.load() == unreservedThreads);
+}
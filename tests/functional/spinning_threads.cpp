@@ -0,0 +1,107 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/thread_abstraction.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <chrono>
+
+constexpr static unsigned kSpinningFanOut = 64;
+constexpr static unsigned kMaxSpinningThreads = 1;
+
+static std::atomic<unsigned> g_spinningLeaves;
+static std::atomic<unsigned> g_maxSpinningSeen;
+
+static void RecordSpinningThreads(ftl::TaskScheduler *taskScheduler) {
+	unsigned const spinning = taskScheduler->GetSpinningThreadCount();
+	unsigned seen = g_maxSpinningSeen.load(std::memory_order_relaxed);
+	while (spinning > seen && !g_maxSpinningSeen.compare_exchange_weak(seen, spinning, std::memory_order_relaxed)) {
+	}
+}
+
+void SpinningLeafTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	RecordSpinningThreads(taskScheduler);
+	g_spinningLeaves.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SpinningBranchTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	ftl::Task tasks[kSpinningFanOut];
+	for (auto &task : tasks) {
+		task = { SpinningLeafTask, nullptr };
+	}
+
+	// The waiting fiber may be resumed by whichever thread gets to it first, so this also exercises ready fibers
+	ftl::WaitGroup wg(taskScheduler);
+	taskScheduler->AddTasks(kSpinningFanOut, tasks, ftl::TaskPriority::Normal, &wg);
+	RecordSpinningThreads(taskScheduler);
+	wg.Wait();
+}
+
+/**
+ * Tests that capping the number of threads looking for work holds, whatever the other threads do when they're idle
+ * No more than MaxSpinningThreads threads spin at once, the rest sleep once they're out of work, and no work is lost
+ */
+TEST_CASE("Max Spinning Threads", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	options.MaxSpinningThreads = kMaxSpinningThreads;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_spinningLeaves.store(0);
+	g_maxSpinningSeen.store(0);
+
+	for (unsigned i = 0; i < 16; ++i) {
+		ftl::Task tasks[kSpinningFanOut];
+		for (auto &task : tasks) {
+			task = { SpinningBranchTask, nullptr };
+		}
+
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTasks(kSpinningFanOut, tasks, i % 2 == 0 ? ftl::TaskPriority::Normal : ftl::TaskPriority::High, &wg);
+		RecordSpinningThreads(&taskScheduler);
+		wg.Wait();
+	}
+
+	REQUIRE(g_spinningLeaves.load() == 16 * kSpinningFanOut * kSpinningFanOut);
+
+	// Now there's no work left, only the spinning threads keep looking. The other workers go to sleep, whatever the behavior
+	// The main thread is busy running this test, so it's neither
+	unsigned const minParked = taskScheduler.GetThreadCount() - 1 - kMaxSpinningThreads;
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (taskScheduler.GetParkedThreadCount() < minParked && std::chrono::steady_clock::now() < deadline) {
+		RecordSpinningThreads(&taskScheduler);
+		ftl::YieldThread();
+	}
+	RecordSpinningThreads(&taskScheduler);
+
+	REQUIRE(taskScheduler.GetParkedThreadCount() >= minParked);
+	REQUIRE(g_maxSpinningSeen.load() <= kMaxSpinningThreads);
+}
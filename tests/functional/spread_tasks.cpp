@@ -0,0 +1,150 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/thread_abstraction.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+constexpr static unsigned kSpreadBatchSize = 10000;
+constexpr static unsigned kSpreadThreadCount = 4;
+constexpr static unsigned kSpreadShareSize = 16;
+constexpr static unsigned kSpreadNoTask = ~0U;
+
+static unsigned g_spreadShareIndices[kSpreadThreadCount * kSpreadShareSize];
+static std::atomic<unsigned> g_spreadShareRuns;
+static std::atomic<unsigned> g_spreadFirstShareTask[kSpreadThreadCount];
+
+void SpreadLeafTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	auto *runs = reinterpret_cast<std::atomic<unsigned> *>(arg);
+	runs->fetch_add(1, std::memory_order_relaxed);
+}
+
+void SpreadNestedTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	// Big batches added from inside a task are split too, from whichever thread we're on
+	std::vector<ftl::Task> tasks(kSpreadBatchSize / 10, { SpreadLeafTask, arg });
+
+	ftl::WaitGroup wg(taskScheduler);
+	taskScheduler->AddTasks(static_cast<unsigned>(tasks.size()), tasks.data(), ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+}
+
+void SpreadShareTask(ftl::TaskScheduler *taskScheduler, void *arg) {
+	unsigned const index = *reinterpret_cast<unsigned *>(arg);
+	unsigned expected = kSpreadNoTask;
+	g_spreadFirstShareTask[taskScheduler->GetCurrentThreadIndex()].compare_exchange_strong(expected, index, std::memory_order_relaxed);
+
+	// Long enough that every thread gets to its own share before anyone else is free to take it
+	ftl::SleepThread(2);
+	g_spreadShareRuns.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Tests that large AddTasks() batches split between the threads all get run, whatever the threads do when they're idle
+ */
+TEST_CASE("Spread Tasks", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kSpreadThreadCount;
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	options.MaxSpinningThreads = GENERATE(0U, 1U);
+	options.SpreadTasksThreshold = 64;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	std::atomic<unsigned> runs{ 0 };
+
+	// Every task has to run exactly once, whichever thread it was handed to
+	std::vector<ftl::Task> tasks(kSpreadBatchSize, { SpreadLeafTask, &runs });
+	for (unsigned i = 0; i < 4; ++i) {
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTasks(kSpreadBatchSize, tasks.data(), i % 2 == 0 ? ftl::TaskPriority::Normal : ftl::TaskPriority::High, &wg);
+		wg.Wait();
+	}
+	REQUIRE(runs.load() == 4 * kSpreadBatchSize);
+
+	// Batches that don't divide evenly between the threads, or that are just over the threshold
+	for (unsigned batchSize : { 64U, 65U, 67U, 1001U }) {
+		runs.store(0);
+		ftl::WaitGroup wg(&taskScheduler);
+		taskScheduler.AddTasks(batchSize, tasks.data(), ftl::TaskPriority::Normal, &wg);
+		wg.Wait();
+		REQUIRE(runs.load() == batchSize);
+	}
+
+	runs.store(0);
+	std::vector<ftl::Task> nested(16, { SpreadNestedTask, &runs });
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(static_cast<unsigned>(nested.size()), nested.data(), ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+	REQUIRE(runs.load() == 16 * (kSpreadBatchSize / 10));
+}
+
+/**
+ * Tests that each thread is handed its share of a large batch up front, and runs it while the thread that added the batch is busy
+ */
+TEST_CASE("Spread Tasks Shares", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kSpreadThreadCount;
+	options.Behavior = GENERATE(ftl::EmptyQueueBehavior::Spin, ftl::EmptyQueueBehavior::Yield, ftl::EmptyQueueBehavior::Sleep, ftl::EmptyQueueBehavior::Adaptive);
+	options.MaxSpinningThreads = GENERATE(0U, 1U);
+	options.SpreadTasksThreshold = kSpreadThreadCount * kSpreadShareSize;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_spreadShareRuns.store(0);
+	for (auto &first : g_spreadFirstShareTask) {
+		first.store(kSpreadNoTask);
+	}
+
+	std::vector<ftl::Task> tasks(kSpreadThreadCount * kSpreadShareSize);
+	for (unsigned i = 0; i < tasks.size(); ++i) {
+		g_spreadShareIndices[i] = i;
+		tasks[i] = { SpreadShareTask, &g_spreadShareIndices[i] };
+	}
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(static_cast<unsigned>(tasks.size()), tasks.data(), ftl::TaskPriority::Normal, &wg);
+
+	// Stay busy, without running any tasks. The other threads' shares still get done
+	unsigned const othersShares = (kSpreadThreadCount - 1) * kSpreadShareSize;
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (g_spreadShareRuns.load(std::memory_order_relaxed) < othersShares && std::chrono::steady_clock::now() < deadline) {
+		ftl::YieldThread();
+	}
+	REQUIRE(g_spreadShareRuns.load() >= othersShares);
+
+	// Thread i was handed the i-th share directly, so that's what it started on
+	for (unsigned i = 1; i < kSpreadThreadCount; ++i) {
+		unsigned const first = g_spreadFirstShareTask[i].load();
+		REQUIRE(first >= i * kSpreadShareSize);
+		REQUIRE(first < (i + 1) * kSpreadShareSize);
+	}
+
+	wg.Wait();
+	REQUIRE(g_spreadShareRuns.load() == kSpreadThreadCount * kSpreadShareSize);
+}
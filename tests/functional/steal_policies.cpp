@@ -0,0 +1,75 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <atomic>
+#include <chrono>
+
+constexpr static unsigned kStealThreadCount = 6;
+constexpr static unsigned kStealLeafCount = 64;
+
+static std::atomic<unsigned> g_stealLeaves;
+static std::atomic<unsigned> g_stealLeafThreads;
+
+void StealLeafTask(ftl::TaskScheduler *taskScheduler, void * /*arg*/) {
+	g_stealLeafThreads.fetch_or(1U << taskScheduler->GetCurrentThreadIndex(), std::memory_order_relaxed);
+	g_stealLeaves.fetch_add(1, std::memory_order_relaxed);
+}
+
+/**
+ * Tests that however the threads pick who to steal from, and however few threads they try at once, they reach every thread
+ */
+TEST_CASE("Steal Policies", "[functional]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = kStealThreadCount;
+	options.VictimSelection = GENERATE(ftl::StealPolicy::Sequential, ftl::StealPolicy::Random, ftl::StealPolicy::PowerOfTwoChoices, ftl::StealPolicy::Hierarchical);
+	options.MaxStealAttempts = GENERATE(0U, 1U, 2U);
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_stealLeaves.store(0);
+	g_stealLeafThreads.store(0);
+
+	ftl::Task tasks[kStealLeafCount];
+	for (auto &task : tasks) {
+		task = { StealLeafTask, nullptr };
+	}
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(kStealLeafCount, tasks, ftl::TaskPriority::Normal, &wg);
+
+	// Keep the main thread busy, so the only way the tasks get run is if the others steal them
+	// The main thread isn't in the first window of any of the others, for Sequential. Give up eventually, so that fails rather than hangs
+	auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (g_stealLeaves.load() != kStealLeafCount && std::chrono::steady_clock::now() < deadline) {
+		ftl::YieldThread();
+	}
+
+	REQUIRE(g_stealLeaves.load() == kStealLeafCount);
+	REQUIRE((g_stealLeafThreads.load() & 1U) == 0);
+	wg.Wait();
+}
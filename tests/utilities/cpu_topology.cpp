@@ -0,0 +1,183 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/cpu_topology.h"
+#include "ftl/task_scheduler.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <algorithm>
+
+/**
+ * Tests that the topology we read is self-consistent, and that placement only reorders it
+ */
+TEST_CASE("CPU Topology", "[utility]") {
+	std::vector<ftl::CpuInfo> const cpus = ftl::GetCpuTopology();
+	REQUIRE(!cpus.empty());
+
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		for (size_t j = i + 1; j < cpus.size(); ++j) {
+			REQUIRE(cpus[i].Id != cpus[j].Id);
+
+			// Rings nest. Sharing a core means sharing a cache, and so on
+			if (cpus[i].CoreId == cpus[j].CoreId) {
+				REQUIRE(cpus[i].CacheId == cpus[j].CacheId);
+				REQUIRE(cpus[i].PackageId == cpus[j].PackageId);
+			}
+		}
+		REQUIRE(ftl::CpuDistance(cpus[i], cpus[i]) == 0);
+	}
+
+	std::vector<ftl::CpuInfo> const ordered = ftl::OrderCpusForPlacement(cpus);
+	REQUIRE(ordered.size() == cpus.size());
+	for (ftl::CpuInfo const &cpu : cpus) {
+		REQUIRE(std::count_if(ordered.begin(), ordered.end(), [&](ftl::CpuInfo const &other) { return other.Id == cpu.Id; }) == 1);
+	}
+}
+
+/**
+ * Tests that physical cores are placed before SMT siblings, and that distance follows the hierarchy
+ */
+TEST_CASE("CPU Placement Order", "[utility]") {
+	unsigned const p = ftl::kMaxCpuCapacity;
+
+	// Two packages, each with two cores of two hardware threads. Numbered the way Linux usually does: siblings last
+	std::vector<ftl::CpuInfo> const cpus = {
+		{ 0, 0, 0, 0, 0, p }, { 1, 1, 0, 0, 0, p }, { 2, 2, 2, 1, 1, p }, { 3, 3, 2, 1, 1, p },
+		{ 4, 0, 0, 0, 0, p }, { 5, 1, 0, 0, 0, p }, { 6, 2, 2, 1, 1, p }, { 7, 3, 2, 1, 1, p },
+	};
+
+	std::vector<ftl::CpuInfo> const ordered = ftl::OrderCpusForPlacement(cpus);
+	unsigned const expected[] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+	for (size_t i = 0; i < ordered.size(); ++i) {
+		REQUIRE(ordered[i].Id == expected[i]);
+	}
+
+	// Siblings numbered next to each other get pulled apart
+	std::vector<ftl::CpuInfo> const interleaved = {
+		{ 0, 0, 0, 0, 0, p }, { 1, 0, 0, 0, 0, p }, { 2, 2, 0, 0, 0, p }, { 3, 2, 0, 0, 0, p },
+	};
+	std::vector<ftl::CpuInfo> const reordered = ftl::OrderCpusForPlacement(interleaved);
+	REQUIRE(reordered[0].Id == 0);
+	REQUIRE(reordered[1].Id == 2);
+	REQUIRE(reordered[2].Id == 1);
+	REQUIRE(reordered[3].Id == 3);
+
+	REQUIRE(ftl::CpuDistance(cpus[0], cpus[4]) == 0);
+	REQUIRE(ftl::CpuDistance(cpus[0], cpus[1]) == 1);
+	REQUIRE(ftl::CpuDistance(cpus[0], cpus[2]) == 4);
+}
+
+/**
+ * Tests that performance cores are placed before efficiency cores, and SMT siblings after both
+ */
+TEST_CASE("Hybrid CPU Placement Order", "[utility]") {
+	// Two performance cores with SMT, then four efficiency cores. The efficiency cores are numbered first, as some firmware does
+	unsigned const p = ftl::kMaxCpuCapacity;
+	unsigned const e = ftl::kMaxCpuCapacity / 2;
+	std::vector<ftl::CpuInfo> const cpus = {
+		{ 0, 0, 1, 0, 0, e }, { 1, 1, 1, 0, 0, e }, { 2, 2, 1, 0, 0, e }, { 3, 3, 1, 0, 0, e },
+		{ 4, 4, 0, 0, 0, p }, { 5, 4, 0, 0, 0, p }, { 6, 6, 0, 0, 0, p }, { 7, 6, 0, 0, 0, p },
+	};
+
+	std::vector<ftl::CpuInfo> const ordered = ftl::OrderCpusForPlacement(cpus);
+	unsigned const expected[] = { 4, 6, 0, 1, 2, 3, 5, 7 };
+	for (size_t i = 0; i < ordered.size(); ++i) {
+		REQUIRE(ordered[i].Id == expected[i]);
+	}
+
+	for (ftl::CpuInfo const &cpu : ftl::GetCpuTopology()) {
+		REQUIRE(cpu.Capacity > 0);
+		REQUIRE(cpu.Capacity <= ftl::kMaxCpuCapacity);
+	}
+}
+
+/**
+ * Tests that we can read and change which CPUs the current thread may run on
+ */
+TEST_CASE("Allowed CPUs", "[utility]") {
+	std::vector<unsigned> const allowed = ftl::GetCurrentThreadAllowedCpus();
+	REQUIRE(!allowed.empty());
+	REQUIRE(std::is_sorted(allowed.begin(), allowed.end()));
+
+	if (ftl::SetCurrentThreadAllowedCpus({ allowed.back() })) {
+		std::vector<unsigned> const pinned = ftl::GetCurrentThreadAllowedCpus();
+		REQUIRE(pinned.size() == 1);
+		REQUIRE(pinned[0] == allowed.back());
+
+		REQUIRE(ftl::SetCurrentThreadAllowedCpus(allowed));
+		REQUIRE(ftl::GetCurrentThreadAllowedCpus() == allowed);
+	}
+}
+
+/**
+ * Tests the thread pinning options, and that the main thread gets its affinity back afterwards
+ */
+TEST_CASE("Thread Pinning", "[utility]") {
+	std::vector<unsigned> const allowed = ftl::GetCurrentThreadAllowedCpus();
+
+	{
+		ftl::TaskScheduler taskScheduler;
+		ftl::TaskSchedulerInitOptions options;
+		options.Pinning = ftl::ThreadPinning::CpuList;
+		options.AffinityCpus = { allowed.back() };
+		REQUIRE(taskScheduler.Init(options) == 0);
+
+		// The pool is sized from the list
+		REQUIRE(taskScheduler.GetThreadCount() == 1);
+	}
+	REQUIRE(ftl::GetCurrentThreadAllowedCpus() == allowed);
+
+	{
+		ftl::TaskScheduler taskScheduler;
+		ftl::TaskSchedulerInitOptions options;
+		options.Pinning = ftl::ThreadPinning::CpuList;
+		// An empty list is an error, rather than falling back to placing the threads ourselves
+		REQUIRE(taskScheduler.Init(options) == -80);
+	}
+	REQUIRE(ftl::GetCurrentThreadAllowedCpus() == allowed);
+
+	{
+		ftl::TaskScheduler taskScheduler;
+		ftl::TaskSchedulerInitOptions options;
+		options.Pinning = ftl::ThreadPinning::None;
+		options.ThreadPoolSize = 2;
+		REQUIRE(taskScheduler.Init(options) == 0);
+
+		// The main thread is left alone
+		REQUIRE(ftl::GetCurrentThreadAllowedCpus() == allowed);
+	}
+
+	{
+		ftl::TaskScheduler taskScheduler;
+		REQUIRE(taskScheduler.Init() == 0);
+
+		// The default pool never has more threads than we're allowed CPUs
+		REQUIRE(taskScheduler.GetThreadCount() <= allowed.size());
+		unsigned const quota = ftl::GetCpuQuota();
+		if (quota != 0) {
+			REQUIRE(taskScheduler.GetThreadCount() <= quota);
+		}
+	}
+	REQUIRE(ftl::GetCurrentThreadAllowedCpus() == allowed);
+}
@@ -67,6 +67,52 @@ TEST_CASE("Parallel For", "[utility]") {
 		);
 	}
 
+	SECTION("Chunks") {
+		std::vector<unsigned> data(size);
+		for (unsigned i = 0; i < size; ++i) {
+			data[i] = i + 1;
+		}
+
+		std::atomic<size_t> largestChunk(0);
+		ftl::ParallelForChunks(
+		    &taskScheduler, data, 15,
+		    [&total, &largestChunk](ftl::TaskScheduler *ts, std::vector<unsigned>::iterator begin, std::vector<unsigned>::iterator end) {
+			    (void)ts;
+			    uint64_t sum = 0;
+			    for (auto iter = begin; iter != end; ++iter) {
+				    sum += *iter;
+			    }
+			    total.fetch_add(sum);
+
+			    size_t const chunkSize = static_cast<size_t>(end - begin);
+			    size_t largest = largestChunk.load();
+			    while (chunkSize > largest && !largestChunk.compare_exchange_weak(largest, chunkSize)) {
+			    }
+		    },
+		    ftl::TaskPriority::Normal
+		);
+		REQUIRE(largestChunk.load() <= 15);
+	}
+	SECTION("Chunks with an automatic batch size") {
+		unsigned data[size];
+		for (unsigned i = 0; i < size; ++i) {
+			data[i] = i + 1;
+		}
+
+		ftl::ParallelForChunks(
+		    &taskScheduler, data, size, 0,
+		    [&total](ftl::TaskScheduler *ts, unsigned *begin, unsigned *end) {
+			    (void)ts;
+			    uint64_t sum = 0;
+			    for (unsigned *value = begin; value != end; ++value) {
+				    sum += *value;
+			    }
+			    total.fetch_add(sum);
+		    },
+		    ftl::TaskPriority::High
+		);
+	}
+
 	constexpr uint64_t expectedValue = size * (size + 1) / 2;
 	REQUIRE(total.load() == expectedValue);
 }
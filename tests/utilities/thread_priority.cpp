@@ -0,0 +1,83 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "ftl/config.h"
+#include "ftl/task_scheduler.h"
+#include "ftl/thread_abstraction.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+#include <thread>
+
+static std::atomic<unsigned> g_priorityTasksRun;
+
+void PriorityTask(ftl::TaskScheduler * /*taskScheduler*/, void * /*arg*/) {
+	g_priorityTasksRun.fetch_add(1, std::memory_order_relaxed);
+}
+
+static bool RunWithWorkerPriority(ftl::ThreadPriorityOptions priority) {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	// Real-time threads that spin or yield would starve the main thread, if we only have one CPU
+	options.Behavior = ftl::EmptyQueueBehavior::Sleep;
+	options.WorkerPriority = priority;
+	options.EfficiencyWorkerPriority = priority;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	g_priorityTasksRun.store(0);
+
+	constexpr unsigned kTaskCount = 256;
+	ftl::Task tasks[kTaskCount];
+	for (auto &task : tasks) {
+		task = { PriorityTask, nullptr };
+	}
+
+	ftl::WaitGroup wg(&taskScheduler);
+	taskScheduler.AddTasks(kTaskCount, tasks, ftl::TaskPriority::Normal, &wg);
+	wg.Wait();
+
+	REQUIRE(g_priorityTasksRun.load() == kTaskCount);
+	return taskScheduler.ThreadPrioritiesApplied();
+}
+
+/**
+ * Tests that the worker threads' OS scheduling policy can be set, and that the scheduler still works if it can't be
+ */
+TEST_CASE("Worker Thread Priority", "[utility]") {
+#if defined(FTL_OS_LINUX)
+	// Lowering our priority never needs privileges
+	std::thread([] {
+		REQUIRE(ftl::SetCurrentThreadPriority(ftl::ThreadSchedulingPolicy::Normal, 5));
+	}).join();
+
+	REQUIRE(RunWithWorkerPriority({ ftl::ThreadSchedulingPolicy::Normal, 5 }));
+#endif
+
+	// These may or may not be allowed. Either way, the tasks have to run
+	RunWithWorkerPriority({ ftl::ThreadSchedulingPolicy::Normal, -5 });
+	RunWithWorkerPriority({ ftl::ThreadSchedulingPolicy::RealtimeFifo, 1 });
+	RunWithWorkerPriority({ ftl::ThreadSchedulingPolicy::RealtimeRoundRobin, 1 });
+}
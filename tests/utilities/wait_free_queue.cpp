@@ -0,0 +1,131 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/wait_free_queue.h"
+
+#include "catch2/catch_test_macros.hpp"
+#include "catch2/generators/catch_generators.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+constexpr static uint64_t kQueueBurstSize = 1 << 16;
+constexpr static unsigned kQueueStealerCount = 3;
+
+/**
+ * Tests that a growable queue gives its memory back once a burst has drained
+ */
+TEST_CASE("Wait Free Queue Shrink", "[utility]") {
+	ftl::WaitFreeQueue<uint64_t> queue;
+	size_t const startingSize = queue.ArraySize();
+
+	for (uint64_t i = 0; i < kQueueBurstSize; ++i) {
+		queue.Push(i);
+	}
+	REQUIRE(queue.ArraySize() >= kQueueBurstSize);
+
+	uint64_t value;
+	for (uint64_t i = kQueueBurstSize; i > 0; --i) {
+		// The owner pops newest first
+		REQUIRE(queue.Pop(&value));
+		REQUIRE(value == i - 1);
+		// Shrinking keeps some slack. And once only a few items are left, it waits until the queue is empty
+		REQUIRE(queue.ArraySize() <= std::max<size_t>(startingSize * 4, (i - 1) * 32));
+	}
+	REQUIRE_FALSE(queue.Pop(&value));
+	REQUIRE(queue.ArraySize() == startingSize);
+
+	// It can still grow again
+	for (uint64_t i = 0; i < kQueueBurstSize; ++i) {
+		queue.Push(i);
+	}
+	REQUIRE(queue.SizeEstimate() == kQueueBurstSize);
+}
+
+/**
+ * Tests that growing and shrinking while other threads steal doesn't lose or duplicate items
+ * Only Pop() and Steal() change with asymmetric fences, so the same test covers them
+ */
+TEST_CASE("Wait Free Queue Resize While Stealing", "[utility]") {
+	bool const asymmetricFences = GENERATE(false, true);
+	ftl::WaitFreeQueue<uint64_t> queue(asymmetricFences);
+	REQUIRE(queue.AsymmetricFences() == (asymmetricFences && ftl::EnableAsymmetricFences()));
+	std::atomic<bool> done{ false };
+	std::atomic<uint64_t> stolenSum{ 0 };
+	std::atomic<uint64_t> stolenCount{ 0 };
+
+	std::vector<std::thread> stealers;
+	for (unsigned i = 0; i < kQueueStealerCount; ++i) {
+		stealers.emplace_back([&] {
+			uint64_t sum = 0;
+			uint64_t count = 0;
+			uint64_t value;
+			while (!done.load(std::memory_order_acquire) || !queue.Empty()) {
+				if (queue.Steal(&value)) {
+					sum += value;
+					++count;
+				} else {
+					std::this_thread::yield();
+				}
+			}
+			stolenSum.fetch_add(sum);
+			stolenCount.fetch_add(count);
+		});
+	}
+
+	uint64_t poppedSum = 0;
+	uint64_t poppedCount = 0;
+	uint64_t nextValue = 1;
+	for (unsigned round = 0; round < 8; ++round) {
+		// Grow in one go, and one at a time
+		std::vector<uint64_t> values(kQueueBurstSize / 2);
+		for (auto &value : values) {
+			value = nextValue++;
+		}
+		queue.PushBatch(values.size(), [&](size_t j) {
+			return values[j];
+		});
+		for (uint64_t j = 0; j < kQueueBurstSize / 2; ++j) {
+			queue.Push(nextValue++);
+		}
+
+		// Then drain it, shrinking on the way
+		uint64_t value;
+		while (queue.Pop(&value)) {
+			poppedSum += value;
+			++poppedCount;
+		}
+	}
+
+	done.store(true, std::memory_order_release);
+	for (auto &stealer : stealers) {
+		stealer.join();
+	}
+
+	uint64_t const total = nextValue - 1;
+	REQUIRE(poppedCount + stolenCount.load() == total);
+	REQUIRE(poppedSum + stolenSum.load() == total * (total + 1) / 2);
+}
@@ -0,0 +1,125 @@
+/**
+ * FiberTaskingLib - A tasking library that uses fibers for efficient task switching
+ *
+ * This library was created as a proof of concept of the ideas presented by
+ * Christian Gyrling in his 2015 GDC Talk 'Parallelizing the Naughty Dog Engine Using Fibers'
+ *
+ * http://gdcvault.com/play/1022186/Parallelizing-the-Naughty-Dog-Engine
+ *
+ * FiberTaskingLib is the legal property of Adrian Astley
+ * Copyright Adrian Astley 2015 - 2018
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ftl/task_scheduler.h"
+#include "ftl/wait_group.h"
+
+#include "catch2/catch_test_macros.hpp"
+
+#include <atomic>
+
+constexpr static unsigned kWaitGroupReuseRounds = 20000;
+constexpr static unsigned kWaitGroupWaiters = 64;
+
+struct WaitGroupReuseArgs {
+	ftl::WaitGroup *Gate;
+	ftl::WaitGroup *Finished;
+	std::atomic<unsigned> *Resumed;
+};
+
+void WaitGroupWaiterTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	auto *args = static_cast<WaitGroupReuseArgs *>(arg);
+	args->Gate->Wait();
+	args->Resumed->fetch_add(1, std::memory_order_relaxed);
+}
+
+void WaitGroupReleaseTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	static_cast<ftl::WaitGroup *>(arg)->Done();
+}
+
+/**
+ * Tests that a WaitGroup can be destroyed as soon as Wait() returns, and a new one made in its place
+ *
+ * The WaitGroups are made at the same stack address every round. So if Add() touched a WaitGroup after it had started
+ * resuming the waiters, it would clobber the next round's waiters, and the test would hang
+ */
+TEST_CASE("WaitGroup Reuse", "[utility]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	std::atomic<unsigned> resumed(0);
+	for (unsigned round = 0; round < kWaitGroupReuseRounds; ++round) {
+		ftl::WaitGroup gate(&taskScheduler);
+		ftl::WaitGroup finished(&taskScheduler);
+		gate.Add(1);
+
+		WaitGroupReuseArgs args = { &gate, &finished, &resumed };
+		for (unsigned i = 0; i < kWaitGroupWaiters; ++i) {
+			taskScheduler.AddTask({ WaitGroupWaiterTask, &args }, ftl::TaskPriority::Normal, &finished);
+		}
+		taskScheduler.AddTask({ WaitGroupReleaseTask, &gate }, ftl::TaskPriority::Normal);
+
+		// We're one of the waiters too. The releasing thread may still be resuming the others when we get back
+		gate.Wait();
+		finished.Wait();
+	}
+
+	REQUIRE(resumed.load() == kWaitGroupReuseRounds * kWaitGroupWaiters);
+}
+
+constexpr static unsigned kWaitGroupChurnTasks = 16;
+constexpr static unsigned kWaitGroupChurnRounds = 10000;
+
+void WaitGroupChurnTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	auto *churn = static_cast<ftl::WaitGroup *>(arg);
+	for (unsigned i = 0; i < kWaitGroupChurnRounds; ++i) {
+		churn->Add(1);
+		churn->Add(-1);
+	}
+}
+
+void WaitGroupChurnWaiterTask(ftl::TaskScheduler * /*taskScheduler*/, void *arg) {
+	auto *churn = static_cast<ftl::WaitGroup *>(arg);
+	for (unsigned i = 0; i < kWaitGroupChurnRounds / 100; ++i) {
+		churn->Wait();
+	}
+}
+
+/**
+ * Tests that a WaitGroup can count up again while the Add() that took it to zero is still releasing the waiters
+ *
+ * The counter goes back and forth between zero and one on every thread at once. If an Add() counted on from the
+ * releasing state, the counter would end up off by one, and the final Wait() would never return
+ */
+TEST_CASE("WaitGroup Add While Releasing", "[utility]") {
+	ftl::TaskScheduler taskScheduler;
+	ftl::TaskSchedulerInitOptions options;
+	options.ThreadPoolSize = 4;
+	REQUIRE(taskScheduler.Init(options) == 0);
+
+	ftl::WaitGroup churn(&taskScheduler);
+	ftl::WaitGroup finished(&taskScheduler);
+	for (unsigned i = 0; i < kWaitGroupChurnTasks; ++i) {
+		taskScheduler.AddTask({ WaitGroupChurnTask, &churn }, ftl::TaskPriority::Normal, &finished);
+		taskScheduler.AddTask({ WaitGroupChurnWaiterTask, &churn }, ftl::TaskPriority::Normal, &finished);
+	}
+	finished.Wait();
+
+	churn.Wait();
+	churn.Add(1);
+	churn.Add(-1);
+	churn.Wait();
+}